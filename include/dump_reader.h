@@ -0,0 +1,105 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef DUMP_READER_H_
+#define DUMP_READER_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A single value of a dump, one per region, event, rank and instance
+struct DumpValue {
+  // the index of the dump this value was loaded from
+  unsigned source;
+  // the rank, zero for dumps written without MPI
+  int rank;
+  // the n-th time the region was dumped by this rank
+  unsigned instance;
+  double value;
+};
+
+// Dumps loaded into a compact index by region, event and rank.
+// Region and event names are interned, values of a region and event are
+// kept together and sorted by source, rank and instance.
+class DumpIndex {
+  public:
+    // Load a csv or HDF5 (when enabled) dump into the index
+    // csv dumps are memory mapped and parsed by num_threads threads
+    // Different indexes can be loaded concurrently
+    // Returns: false if the dump couldn't be read
+    bool load(const std::string &path, const unsigned num_threads);
+
+    // Names of the loaded dumps, regions and events in order of appearance
+    const std::vector<std::string>& sources() const {
+      return sources_;
+    }
+    const std::vector<std::string>& regions() const {
+      return regions_;
+    }
+    const std::vector<std::string>& events() const {
+      return events_;
+    }
+
+    // Index of a region or event name
+    // Returns: -1 if the name isn't in the index
+    int find_region(const std::string &name) const;
+    int find_event(const std::string &name) const;
+
+    // The events of a region in order of appearance
+    const std::vector<unsigned>& region_events(const unsigned region) const {
+      return region_events_[region];
+    }
+
+    // The values of a region and event
+    // Returns: nullptr if there are no values
+    const std::vector<DumpValue>* values(const unsigned region,
+                                         const unsigned event) const;
+
+  private:
+    // Intern a name, adding it to the names if it is new
+    unsigned intern_region(const std::string &name);
+    unsigned intern_event(const std::string &name);
+
+    // Add a value of the current source
+    void add(const unsigned region, const unsigned event,
+              const int rank, const double value);
+
+    // Sort the values of the current source and number the instances
+    void finish_source();
+
+    bool load_csv(const std::string &path, const unsigned num_threads);
+#ifdef ENABLE_HDF5
+    bool load_hdf5(const std::string &path);
+#endif
+
+    static uint64_t key(const unsigned region, const unsigned event) {
+      return (static_cast<uint64_t>(region) << 32) | event;
+    }
+
+    std::vector<std::string> sources_, regions_, events_;
+    std::unordered_map<std::string,unsigned> region_ids_, event_ids_;
+    std::vector<std::vector<unsigned>> region_events_;
+    std::unordered_map<uint64_t,std::vector<DumpValue>> values_;
+    // the first value of the current source for each region and event
+    std::unordered_map<uint64_t,size_t> source_start_;
+};
+
+#endif //DUMP_READER_H_
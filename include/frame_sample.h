@@ -0,0 +1,40 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FRAME_SAMPLE_H_
+#define FRAME_SAMPLE_H_
+
+#include <Python.h>
+
+// The code object and instruction offset (in bytes) being executed by a
+// thread, the code object is borrowed and null outside of Python code
+struct FrameSample {
+  PyObject *code;
+  int addr;
+};
+
+// Whether frames can be read by sample_frame in this version of Python,
+// it reads the frames of CPython 3.10 to 3.13
+bool frame_sampling_supported();
+
+// Read the innermost Python frame of a thread state in a signal handler on
+// the thread, without allocating, locking or changing reference counts
+void sample_frame(PyThreadState *tstate, FrameSample &sample);
+
+#endif //FRAME_SAMPLE_H_
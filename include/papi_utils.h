@@ -42,24 +42,31 @@
 // Thin wrapper around PAPI's event set API.  Makes it easy to get some events
 // from the environment and add them to an event set.  This handles all the
 // name to code translation and keeps track of the particular events beng
-// monitored.
+// monitored.  Events of different PAPI components (e.g., the CPU, network,
+// I/O or software counters) are kept in one PAPI event set per component,
+// these are started and stopped together and their values are merged.
 class PAPIEventSet {
   public:
     // Create an empty event set.
     PAPIEventSet();
 
-    // Free the underlying event set.
+    // Free the underlying event sets.
     ~PAPIEventSet();
 
     // Start the counters in this event set.
     void start() {
-      PAPI_CHECK(PAPI_start(event_set_), "%s", "start()");
+      for (const auto &event_set : event_sets_)
+        PAPI_CHECK(PAPI_start(event_set), "%s", "start()");
     }
 
     // Stop the counters in this event set and put their
     // values into this->values.
     void stop() {
-      PAPI_CHECK(PAPI_stop(event_set_, values), "%s", "stop()");
+      // stop in reverse order of start, values are grouped by component
+      for (size_t i = event_sets_.size(); i-- > 0;) {
+        PAPI_CHECK(PAPI_stop(event_sets_[i], values + offsets_[i]),
+                    "%s", "stop()");
+      }
     }
 
     // Number of events in this event set.
@@ -69,26 +76,70 @@ class PAPIEventSet {
 
     // Read a list of event names/codes
     // Adds valid events to this PAPIEventSet
-    // Number of events is limited to the number the architecture supports
+    // Number of events of a component is limited to the number of counters
+    // the component supports
     // Returns: The number of events that have been added.
     size_t add_from_names(std::vector<std::string> &event_names);
     size_t add_from_codes(std::vector<int> &event_codes);
 
+    // Names of the events, grouped by component in the order components
+    // were first added
     const std::vector<std::string>& event_names() const {
       return event_names_;
     }
 
+    // Call handler every threshold counts of an event, set before start()
+    // Returns: false if the event isn't in this event set
+    bool overflow(const std::string &name, const int threshold,
+                  PAPI_overflow_handler_t handler);
+
+    // Create the PAPI event sets again on the calling thread with the same
+    // events and overflow handlers, call while stopped.  PAPI counts, and
+    // signals the overflows of, the thread that created an event set.
+    void recreate();
+
+    // Indices in values of the events that overflowed in a PAPI event set
+    // of this event set, safe to call from the overflow handler
+    // Returns: The number of indices, at most max_indices
+    int overflow_indices(const int papi_event_set,
+                          const long long overflow_vector,
+                          int *indices, const int max_indices) const;
+
     // Values of the events counted by this event set.
     // Valid after a call to stop().
     long long *values;
 
   private:
 
-    // PAPI event set handle
-    int event_set_;
+    // Add an event to the PAPI event set of its component
+    // Returns: true if the event was added
+    bool add_event(const int event, const std::string &name);
+
+    // Combine the names of each component and allocate values
+    size_t finish_adding();
+
+    // PAPI event set handles, one per component
+    std::vector<int> event_sets_;
+
+    // Component index of each PAPI event set
+    std::vector<int> components_;
+
+    // Names of events added to each PAPI event set
+    std::vector<std::vector<std::string>> set_event_names_;
+
+    // Offset of each PAPI event set's values in values
+    std::vector<size_t> offsets_;
 
     // Names of events added to the event set
     std::vector<std::string> event_names_;
+
+    // Events sampled with overflow(), set again by recreate()
+    struct Overflow {
+      std::string name;
+      int threshold;
+      PAPI_overflow_handler_t handler;
+    };
+    std::vector<Overflow> overflows_;
 };
 
 #endif // PAPI_UTILS_H
@@ -20,7 +20,9 @@
 #ifndef PYPERFDUMP_H_
 #define PYPERFDUMP_H_
 
+#include <string>
 #include <unordered_map>
+#include <vector>
 #include "papi_utils.h"
 
 #ifdef USE_MPI
@@ -39,19 +41,31 @@
     }                                                             \
   }while(false)
 
+// The values of a region, passed to the dump functions
+// Values are written in the order of counter_names then metric_names
+struct RegionRecord {
+  // Integer values, e.g., PAPI counters
+  std::vector<std::string> counter_names;
+  std::unordered_map<std::string,unsigned long long> counters;
+  // Floating point values, e.g., Runtime
+  std::vector<std::string> metric_names;
+  std::unordered_map<std::string,double> metrics;
+};
+
+// Append lines to a text file, with MPI each rank's lines follow the lines
+// of the previous rank and all ranks must call this collectively
+void dumplines(const int rank, const int num_procs,
+                const char *const filename,
+                const std::string &lines);
 void dumpcsv(const int rank, const int num_procs,
               const char *const filename,
               const char *const region_name,
-              const PAPIEventSet *const event_set,
-              std::unordered_map<std::string,unsigned long long> &buffer,
-              const double runtime);
+              RegionRecord &record);
 #ifdef ENABLE_HDF5
 void dumphdf5(const int rank, const int num_procs,
               const char *const filename,
               const char *const region_name,
-              const PAPIEventSet *const event_set,
-              std::unordered_map<std::string,unsigned long long> &buffer,
-              const double runtime);
+              RegionRecord &record);
 #endif
 
 #endif //PYPERFDUMP_H_
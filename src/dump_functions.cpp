@@ -17,8 +17,11 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <limits>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include "papi_utils.h"
@@ -34,19 +37,18 @@
   #include <hdf5.h>
 #endif
 
-void dumpcsv(const int rank, const int num_procs,
-              const char *const filename,
-              const char *const region_name,
-              const PAPIEventSet *const event_set,
-              std::unordered_map<std::string,unsigned long long> &buffer,
-              const double runtime) {
+void dumplines(const int rank, const int num_procs,
+                const char *const filename,
+                const std::string &lines) {
 #ifdef USE_MPI
-  // the length of each process' contribution to the csv
-  unsigned int lens[num_procs];
-  // the length of this rank begins at zero
-  lens[rank] = 0;
-  // a buffer that will be used to build intermediate strings
-  char linebuffer[256];
+  // the length of each process' contribution to the file, 64-bit since a
+  // trace can be larger than an int
+  long long lens[num_procs];
+  lens[rank] = lines.size();
+  // start a non-blocking allgather of the lengths while opening the file
+  MPI_Request request;
+  MPI_Iallgather(MPI_IN_PLACE, 1, MPI_LONG_LONG,
+                  lens, 1, MPI_LONG_LONG, MPI_COMM_WORLD, &request);
   // the output file
   // open at end, create if doesn't exist, write only, no concurrent opens
   MPI_File output_file;
@@ -56,50 +58,68 @@ void dumpcsv(const int rank, const int num_procs,
   // the current offset is the end of the file, this is the offset start
   MPI_Offset offset;
   MPI_File_get_position(output_file, &offset);
-  // gather the length of our rank's data
-  for (const auto &event : event_set->event_names()) {
-    snprintf(linebuffer, 256, "%d,%s,%s,%llu\n",
-                            rank, region_name, event.c_str(), buffer[event]);
-    lens[rank] += strlen(linebuffer);
+  // wait for lengths to determine offset
+  MPI_Wait(&request, MPI_STATUS_IGNORE);
+  long long max_len = 0;
+  for (int i=0;i<num_procs;++i) {
+    if (i < rank)
+      offset += lens[i];
+    max_len = std::max(max_len, lens[i]);
   }
-  // precision of 7 decimals matched hdf5 output in test
-  snprintf(linebuffer, 256, "%d,%s,Runtime,%.7f\n",
-                            rank, region_name, runtime);
-  lens[rank] += strlen(linebuffer);
-  // this rank's length is calculated, start a non-blocking allgather
-  MPI_Request request;
-  MPI_Iallgather(MPI_IN_PLACE, 1, MPI_UNSIGNED,
-                  lens, 1, MPI_UNSIGNED, MPI_COMM_WORLD, &request);
-  // start with a null string for strcat
-  char *lines = (char*)malloc(sizeof(char)*(lens[rank]+1));
-  lines[0] = '\0';
+  // the count of a write is an int, write in chunks of at most 1 GiB, each
+  // rank makes the same number of collective writes, empty when done
+  const long long chunk = 1LL << 30;
+  for (long long written = 0; written < max_len; written += chunk) {
+    const long long start = std::min(written, lens[rank]);
+    const int count = std::min(chunk, lens[rank] - start);
+    MPI_File_write_at_all(output_file, offset + start, lines.c_str() + start,
+                          count, MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  MPI_File_close(&output_file);
+#else //ifndef USE_MPI
+  std::ofstream output_file(filename, std::ios::app);
+  output_file << lines;
+  output_file.close();
+#endif
+}
+
+void dumpcsv(const int rank, const int num_procs,
+              const char *const filename,
+              const char *const region_name,
+              RegionRecord &record) {
   // build 1 big string
-  for (const auto &event : event_set->event_names()) {
+  std::string lines;
+#ifdef USE_MPI
+  // a buffer that will be used to build intermediate strings
+  char linebuffer[256];
+  for (const auto &event : record.counter_names) {
     snprintf(linebuffer, 256, "%d,%s,%s,%llu\n",
-                            rank, region_name, event.c_str(), buffer[event]);
-    strcat(lines, linebuffer);
+              rank, region_name, event.c_str(), record.counters[event]);
+    lines += linebuffer;
   }
-  snprintf(linebuffer, 256, "%d,%s,Runtime,%.7f\n",
-                            rank, region_name, runtime);
-  strcat(lines, linebuffer);
-  // we have our string built, wait for lengths to determine offset
-  MPI_Wait(&request, MPI_STATUS_IGNORE);
-  for (int i=0;i<rank;++i) {
-    offset += lens[i];
+  // metrics are written with the digits to read back the same double,
+  // byte counts are exact
+  for (const auto &metric : record.metric_names) {
+    snprintf(linebuffer, 256, "%d,%s,%s,%.*g\n",
+              rank, region_name, metric.c_str(),
+              std::numeric_limits<double>::max_digits10,
+              record.metrics[metric]);
+    lines += linebuffer;
   }
-  MPI_File_write_at_all(output_file, offset, lines,
-                        lens[rank], MPI_CHAR, MPI_STATUS_IGNORE);
-  MPI_File_close(&output_file);
 #else //ifndef USE_MPI
-  std::ofstream output_file(filename, std::ios::app);
-  for (const auto &event : event_set->event_names()) {
-    output_file << region_name << "," << event << ","
-                << buffer[event] << std::endl;
+  std::ostringstream stream;
+  stream.precision(std::numeric_limits<double>::max_digits10);
+  for (const auto &event : record.counter_names) {
+    stream << region_name << "," << event << ","
+            << record.counters[event] << "\n";
   }
-  output_file << region_name << "," << "Runtime" << ","
-              << runtime << std::endl;
-  output_file.close();
+  for (const auto &metric : record.metric_names) {
+    stream << region_name << "," << metric << ","
+            << record.metrics[metric] << "\n";
+  }
+  lines = stream.str();
 #endif
+  dumplines(rank, num_procs, filename, lines);
 }
 
 #ifdef ENABLE_HDF5
@@ -136,7 +156,7 @@ static hid_t open_hdf5(const char *const filename) {
 
 static void create_datasets(const int num_procs,
                             const char *const region_name,
-                            const PAPIEventSet *const event_set,
+                            const RegionRecord &record,
                             const hid_t h5file) {
   hsize_t cur_dims[]   = {static_cast<hsize_t>(num_procs),
                           1,
@@ -165,31 +185,29 @@ static void create_datasets(const int num_procs,
       group_id = H5Gcreate(h5file, region_name,
                             H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
   }
-  for (const auto &event : event_set->event_names()) {
+  // counters are integer datasets and metrics are floating point datasets
+  const size_t num_counters = record.counter_names.size();
+  const size_t num_datasets = num_counters + record.metric_names.size();
+  for (size_t i = 0; i < num_datasets; ++i) {
+    const std::string &name = (i < num_counters)?
+                              record.counter_names[i] :
+                              record.metric_names[i - num_counters];
+    const hid_t data_type = (i < num_counters)?
+                            H5T_NATIVE_LLONG : H5T_NATIVE_DOUBLE;
     hid_t space = H5Screate_simple(ndim, cur_dims, max_dims);
     hid_t chunk_plist = H5Pcreate(H5P_DATASET_CREATE);
     const int status = H5Pset_chunk(chunk_plist, ndim, chunk_dims);
     PD_ASSERT(status >= 0,
               "setting size of chunks, H5Pset_chunk returned %d", status);
-    const htri_t exists = H5Lexists(group_id, event.c_str(), H5P_DEFAULT);
+    const htri_t exists = H5Lexists(group_id, name.c_str(), H5P_DEFAULT);
     if (!exists) {
-      hid_t dset = H5Dcreate(group_id,event.c_str(),H5T_NATIVE_LLONG,
+      hid_t dset = H5Dcreate(group_id, name.c_str(), data_type,
                               space, H5P_DEFAULT, chunk_plist, H5P_DEFAULT);
       H5Dclose(dset);
     }
     H5Pclose(chunk_plist);
     H5Sclose(space);
   }
-  hid_t space = H5Screate_simple(ndim, cur_dims, max_dims);
-  hid_t chunk_plist = H5Pcreate(H5P_DATASET_CREATE);
-  const int status = H5Pset_chunk(chunk_plist, ndim, chunk_dims);
-  PD_ASSERT(status >= 0,
-            "setting size of chunks, H5Pset_chunk returned %d", status);
-  hid_t dset = H5Dcreate(group_id, "Runtime", H5T_NATIVE_DOUBLE,
-                          space, H5P_DEFAULT, chunk_plist, H5P_DEFAULT);
-  H5Pclose(chunk_plist);
-  H5Dclose(dset);
-  H5Sclose(space);
   H5Gclose(group_id);
 }
 
@@ -226,9 +244,7 @@ static void append_row(const int rank,
 void dumphdf5(const int rank, const int num_procs,
               const char *const filename,
               const char *const region_name,
-              const PAPIEventSet *const event_set,
-              std::unordered_map<std::string,unsigned long long> &buffer,
-              const double runtime) {
+              RegionRecord &record) {
   /* Save old error handler */
   H5E_auto2_t oldfunc;
   void *old_client_data;
@@ -238,14 +254,16 @@ void dumphdf5(const int rank, const int num_procs,
   H5Eset_auto(H5E_DEFAULT, NULL, NULL);
 
   const hid_t dump_file_id = open_hdf5(filename);
-  create_datasets(num_procs, region_name, event_set, dump_file_id);
+  create_datasets(num_procs, region_name, record, dump_file_id);
 
-  for (const auto &event : event_set->event_names()) {
-    append_row(rank, region_name,
-                dump_file_id, event, H5T_NATIVE_LLONG, (void*)&buffer[event]);
+  for (const auto &event : record.counter_names) {
+    append_row(rank, region_name, dump_file_id, event,
+                H5T_NATIVE_LLONG, (void*)&record.counters[event]);
+  }
+  for (const auto &metric : record.metric_names) {
+    append_row(rank, region_name, dump_file_id, metric,
+                H5T_NATIVE_DOUBLE, (void*)&record.metrics[metric]);
   }
-  append_row(rank, region_name,
-              dump_file_id, "Runtime", H5T_NATIVE_DOUBLE, (void*)&runtime);
 
   H5Fclose(dump_file_id);
 
@@ -0,0 +1,70 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+// The frames of a thread are only in CPython's internal headers since 3.11,
+// these are only included here
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#if PY_VERSION_HEX >= 0x030B0000 && PY_VERSION_HEX < 0x030E0000
+  #define Py_BUILD_CORE
+  #include <internal/pycore_frame.h>
+#elif PY_VERSION_HEX >= 0x030A0000 && PY_VERSION_HEX < 0x030B0000
+  #include <frameobject.h>
+#endif
+
+#include "frame_sample.h"
+
+bool frame_sampling_supported() {
+  return PY_VERSION_HEX >= 0x030A0000 && PY_VERSION_HEX < 0x030E0000;
+}
+
+void sample_frame(PyThreadState *tstate, FrameSample &sample) {
+  sample.code = nullptr;
+  sample.addr = 0;
+#if PY_VERSION_HEX >= 0x030B0000 && PY_VERSION_HEX < 0x030E0000
+  #if PY_VERSION_HEX >= 0x030D0000
+  _PyInterpreterFrame *frame = tstate->current_frame;
+  #else
+  _PyInterpreterFrame *frame = tstate->cframe->current_frame;
+  #endif
+  // skip frames that are being set up or belong to C
+  while (frame && _PyFrame_IsIncomplete(frame))
+    frame = frame->previous;
+  if (!frame)
+    return;
+  #if PY_VERSION_HEX >= 0x030D0000
+  if (!PyCode_Check(frame->f_executable))
+    return;
+  sample.code = frame->f_executable;
+  #else
+  sample.code = reinterpret_cast<PyObject*>(frame->f_code);
+  #endif
+  sample.addr = _PyInterpreterFrame_LASTI(frame) * sizeof(_Py_CODEUNIT);
+#elif PY_VERSION_HEX >= 0x030A0000
+  PyFrameObject *frame = tstate->frame;
+  if (!frame)
+    return;
+  sample.code = reinterpret_cast<PyObject*>(frame->f_code);
+  // the offset is -1 before the first instruction
+  sample.addr = (frame->f_lasti < 0)?
+                0 : frame->f_lasti * static_cast<int>(sizeof(_Py_CODEUNIT));
+#else
+  (void)tstate;
+#endif
+}
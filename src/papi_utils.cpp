@@ -14,21 +14,73 @@
 
 #include "papi_utils.h"
 
-PAPIEventSet::PAPIEventSet(): event_set_(PAPI_NULL) {
+PAPIEventSet::PAPIEventSet() {
   values = nullptr;
-  event_set_ = PAPI_NULL;
-  PAPI_CHECK(PAPI_create_eventset(&event_set_), "%s", "create_eventset()");
 }
 
 PAPIEventSet::~PAPIEventSet() {
   if (values) delete [] values;
-  PAPI_CHECK(PAPI_cleanup_eventset(event_set_), "%s", "cleanup_eventset()");
-  PAPI_CHECK(PAPI_destroy_eventset(&event_set_), "%s", "destroy_eventset()");
+  for (auto &event_set : event_sets_) {
+    PAPI_CHECK(PAPI_cleanup_eventset(event_set), "%s", "cleanup_eventset()");
+    PAPI_CHECK(PAPI_destroy_eventset(&event_set), "%s", "destroy_eventset()");
+  }
+}
+
+bool PAPIEventSet::add_event(const int event, const std::string &name) {
+  const int component = PAPI_get_event_component(event);
+  if (component < 0) {
+    std::fprintf(stderr,
+                "PAPI WARNING: Unable to get component of \"%s\", %s (%d)\n",
+                name.c_str(), PAPI_strerror(component), component);
+    return false;
+  }
+  // find or create the event set of this component
+  size_t i = std::find(components_.begin(), components_.end(), component)
+              - components_.begin();
+  if (i == components_.size()) {
+    int event_set = PAPI_NULL;
+    PAPI_CHECK(PAPI_create_eventset(&event_set), "%s", "create_eventset()");
+    event_sets_.push_back(event_set);
+    components_.push_back(component);
+    set_event_names_.push_back(std::vector<std::string>());
+  }
+  // a component without a counter limit reports no hardware counters
+  const int num_counters = PAPI_num_cmp_hwctrs(component);
+  if (num_counters > 0 &&
+      set_event_names_[i].size() >= static_cast<size_t>(num_counters))
+    return false;
+  if (PAPI_add_event(event_sets_[i], event) != PAPI_OK)
+    return false;
+  set_event_names_[i].push_back(name);
+  return true;
+}
+
+size_t PAPIEventSet::finish_adding() {
+  // drop event sets of components where no event could be added
+  for (size_t i = event_sets_.size(); i-- > 0;) {
+    if (set_event_names_[i].empty()) {
+      PAPI_CHECK(PAPI_destroy_eventset(&event_sets_[i]),
+                  "%s", "destroy_eventset()");
+      event_sets_.erase(event_sets_.begin() + i);
+      components_.erase(components_.begin() + i);
+      set_event_names_.erase(set_event_names_.begin() + i);
+    }
+  }
+  // the values of each event set follow the values of the previous set
+  event_names_.clear();
+  offsets_.clear();
+  for (const auto &names : set_event_names_) {
+    offsets_.push_back(event_names_.size());
+    event_names_.insert(event_names_.end(), names.begin(), names.end());
+  }
+  const size_t count = event_names_.size();
+  if (values) delete [] values;
+  values = new long long[count];
+  std::fill_n(values, count, 0);
+  return count;
 }
 
 size_t PAPIEventSet::add_from_names(std::vector<std::string> &event_names) {
-  const size_t num_counters = (size_t)PAPI_num_hwctrs();
-  size_t count = 0;
   for (const auto &name : event_names) {
     int event;
     const int papi_code = PAPI_event_name_to_code(name.c_str(), &event);
@@ -37,20 +89,13 @@ size_t PAPIEventSet::add_from_names(std::vector<std::string> &event_names) {
                   "PAPI WARNING: Unable to get code from \"%s\", %s (%d)\n",
                   name.c_str(), PAPI_strerror(papi_code), papi_code);
     }
-    else if (PAPI_add_event(event_set_, event) == PAPI_OK) {
-      event_names_.push_back(name);
-      if (++count == num_counters)
-        break;
-    }
+    else
+      add_event(event, name);
   }
-  values = new long long[count];
-  std::fill_n(values, count, 0);
-  return count;
+  return finish_adding();
 }
 
 size_t PAPIEventSet::add_from_codes(std::vector<int> &event_codes) {
-  const size_t num_counters = (size_t)PAPI_num_hwctrs();
-  size_t count = 0;
   for (const auto &event : event_codes) {
     char name[PAPI_MAX_STR_LEN];
     const int papi_code = PAPI_event_code_to_name(event, name);
@@ -59,13 +104,80 @@ size_t PAPIEventSet::add_from_codes(std::vector<int> &event_codes) {
                   "PAPI WARNING: Unable to get name from \"%d\", %s (%d)\n",
                   event, PAPI_strerror(papi_code), papi_code);
     }
-    else if (PAPI_add_event(event_set_, event) == PAPI_OK) {
-      event_names_.push_back(name);
-      if (++count == num_counters)
-        break;
+    else
+      add_event(event, name);
+  }
+  return finish_adding();
+}
+
+bool PAPIEventSet::overflow(const std::string &name, const int threshold,
+                            PAPI_overflow_handler_t handler) {
+  for (size_t i = 0; i < event_sets_.size(); ++i) {
+    const std::vector<std::string> &names = set_event_names_[i];
+    if (std::find(names.begin(), names.end(), name) == names.end())
+      continue;
+    int event;
+    int papi_code = PAPI_event_name_to_code(name.c_str(), &event);
+    if (papi_code == PAPI_OK)
+      papi_code = PAPI_overflow(event_sets_[i], event, threshold, 0, handler);
+    if (papi_code != PAPI_OK) {
+      std::fprintf(stderr,
+                  "PAPI WARNING: Unable to sample \"%s\", %s (%d)\n",
+                  name.c_str(), PAPI_strerror(papi_code), papi_code);
+      return false;
     }
+    Overflow sampled = {name, threshold, handler};
+    overflows_.push_back(sampled);
+    return true;
   }
-  values = new long long[count];
-  std::fill_n(values, count, 0);
-  return count;
+  return false;
+}
+
+void PAPIEventSet::recreate() {
+  for (auto &event_set : event_sets_) {
+    PAPI_CHECK(PAPI_cleanup_eventset(event_set), "%s", "cleanup_eventset()");
+    PAPI_CHECK(PAPI_destroy_eventset(&event_set), "%s", "destroy_eventset()");
+  }
+  const std::vector<std::vector<std::string>> set_event_names =
+                                                            set_event_names_;
+  event_sets_.clear();
+  components_.clear();
+  set_event_names_.clear();
+  // add the events in the same order, the values keep their order
+  for (const auto &names : set_event_names) {
+    for (const auto &name : names) {
+      int event;
+      PAPI_CHECK(PAPI_event_name_to_code(name.c_str(), &event),
+                  "event_name_to_code(\"%s\")", name.c_str());
+      if (!add_event(event, name)) {
+        std::fprintf(stderr, "PAPI ERROR: Unable to add \"%s\" again\n",
+                      name.c_str());
+        PAPI_ABORT;
+      }
+    }
+  }
+  finish_adding();
+  const std::vector<Overflow> overflows = overflows_;
+  overflows_.clear();
+  for (const auto &sampled : overflows)
+    overflow(sampled.name, sampled.threshold, sampled.handler);
+}
+
+int PAPIEventSet::overflow_indices(const int papi_event_set,
+                                    const long long overflow_vector,
+                                    int *indices,
+                                    const int max_indices) const {
+  for (size_t i = 0; i < event_sets_.size(); ++i) {
+    if (event_sets_[i] != papi_event_set)
+      continue;
+    int count = max_indices;
+    if (PAPI_get_overflow_event_index(event_sets_[i], overflow_vector,
+                                      indices, &count) != PAPI_OK)
+      return 0;
+    // indices are within the PAPI event set, offset them into values
+    for (int j = 0; j < count; ++j)
+      indices[j] += offsets_[i];
+    return count;
+  }
+  return 0;
 }
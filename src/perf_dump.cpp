@@ -20,13 +20,27 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #ifdef USE_MPI
   #include <mpi.h>
 #else
@@ -37,62 +51,1219 @@
   #include <hdf5.h>
 #endif
 
+#include "frame_sample.h"
 #include "papi_utils.h"
 #include "pyperfdump.h"
 
 // This module changes and relies on current state
-static enum {PD_NOTSTARTED, PD_LIBINIT, PD_INREGION, PD_INPROFILE}
-             current_state = PD_NOTSTARTED;
-// rank=0 and num_procs=1 for non-MPI usage
-static int rank=0, num_procs=1;
-// region_count is a counter for unnamed regions -> region_1, region_2, ...
-static int region_count = 0;
-// the filename for output, includes both the path and filename
-static std::string filename;
-// the current event set, setup from environment variables in init()
-static PAPIEventSet* event_set=nullptr;
-// the region name, used in the output
-// generic_region_name is used when region is unnamed and deleted in end_region
-static char *region_name, *generic_region_name=nullptr;
+enum PDState {PD_NOTSTARTED, PD_LIBINIT, PD_INREGION, PD_INPROFILE,
+              PD_INMEASURE};
+
+// the dump functions write a record of a region
+typedef void (*dump_function)(const int, const int,
+                              const char *const, const char *const,
+                              RegionRecord &);
+
+// bin 0 counts zeros, bin b counts values in [2^(b-1), 2^b)
+static const size_t num_bins = 65;
+
+// the aggregate of every completed instance of a region
+struct RegionAggregate {
+  RegionAggregate(PyObject *name, const size_t num_counters,
+                  const size_t num_metrics, const bool histogram)
+    : name(name), count(0),
+      counter_sum(num_counters, 0),
+      counter_min(num_counters, std::numeric_limits<unsigned long long>::max()),
+      counter_max(num_counters, 0),
+      metric_sum(num_metrics, 0.0),
+      metric_min(num_metrics, std::numeric_limits<double>::max()),
+      metric_max(num_metrics, std::numeric_limits<double>::lowest()),
+      // the counters and the Runtime (in nanoseconds) have histograms
+      bins((histogram)? (num_counters + 1) * num_bins : 0, 0) {}
+  // the interned region name, a reference is held by the aggregate
+  PyObject *name;
+  unsigned long long count;
+  std::vector<unsigned long long> counter_sum, counter_min, counter_max;
+  std::vector<double> metric_sum, metric_min, metric_max;
+  std::vector<unsigned long long> bins;
+};
+
+// a sampled Python function, the code object and the line being executed
+struct SampleKey {
+  PyObject *code;
+  int line;
+  bool operator==(const SampleKey &other) const {
+    return code == other.code && line == other.line;
+  }
+};
+struct SampleKeyHash {
+  size_t operator()(const SampleKey &key) const {
+    return std::hash<PyObject*>()(key.code) ^
+            (static_cast<size_t>(key.line) * 0x9e3779b97f4a7c15ULL);
+  }
+};
+// the overflow samples of a region, counts of each counter by function
+// a reference is held to the region name and to each code object
+struct RegionSamples {
+  PyObject *name;
+  std::unordered_map<SampleKey,std::vector<unsigned long long>,
+                      SampleKeyHash> counts;
+};
+
+// the memory usage of the profiled thread (faults) and process (bytes)
+struct MemoryUsage {
+  // the thread the faults were read from
+  pthread_t thread;
+  long long minor_faults, major_faults;
+  long long rss, peak_rss;
+  // the current and peak bytes traced by tracemalloc, if it was tracing
+  bool py_traced;
+  long long py_current, py_peak;
+};
+
+// a region or profile of the trace, times are seconds of this rank's clock
+struct TraceEvent {
+  double start, duration;
+  // the index of the region name in trace_names
+  unsigned name;
+  // the event set of a profile, or -1 for a region
+  int set;
+  // the offset of a profile's counter values in trace_values
+  size_t values;
+};
+
+// The state of a pyperfdump module object, one per (sub)interpreter
+struct PyPerfDumpState {
+  // an error object to raise exceptions
+  PyObject *error = nullptr;
+  PDState current_state = PD_NOTSTARTED;
+  // rank=0 and num_procs=1 for non-MPI usage
+  int rank = 0, num_procs = 1;
+  // region_count is a counter for unnamed regions -> region_1, region_2, ...
+  int region_count = 0;
+  // the filename for output, includes both the path and filename
+  std::string filename;
+  // the event sets, setup from environment variables in init()
+  // with multiple event groups each profile rotates to the next event set
+  std::vector<PAPIEventSet*> event_sets;
+  // the index of the event set used by the current (or next) profile
+  size_t current_set = 0;
+  // the profiled runtime of each event set within the current region
+  std::vector<double> set_runtime;
+  // the thread that created the event sets, PAPI counts this thread
+  pthread_t event_thread;
+  // the region name, used in the output
+  // region_name_obj is an interned string held from start to end of a region
+  PyObject *region_name_obj = nullptr;
+  // the start time of the current profile from wtime()
+  double t_start;
+  double runtime = 0.0;
+  // record holds the counter and metric names and values for the dump
+  RegionRecord record;
+  // the dump function we use is a pointer, set in init()
+  dump_function dump = nullptr;
+  // with PDUMP_AGGREGATE, completed regions are accumulated by name
+  // and one record per distinct region is dumped in finalize()
+  bool aggregate = false;
+  // with PDUMP_HISTOGRAM, also count values in log2-scale bins
+  bool histogram = false;
+  // aggregates in order of first completion, indexed by interned region name
+  std::vector<RegionAggregate> aggregates;
+  std::unordered_map<PyObject*,size_t> aggregate_ids;
+  // the names of aggregate values for the dump, built once in init()
+  RegionRecord aggregate_record;
+  // with PDUMP_OVERFLOW, events are sampled on counter overflow and samples
+  // are attributed to the Python function and line of the profiled thread
+  bool sampling = false;
+  // the overflow threshold of each counter, zero if it isn't sampled
+  std::vector<long long> sample_thresholds;
+  // the index in record.counter_names of each value of each event set
+  std::vector<std::vector<size_t>> set_counter_index;
+  // samples of regions in order of first sample, indexed by region name
+  std::vector<RegionSamples> region_samples;
+  std::unordered_map<PyObject*,size_t> region_sample_ids;
+  // the filename for the samples, a csv next to the dump
+  std::string sample_filename;
+  // with PDUMP_TRACE, each region and profile is recorded with its times
+  // and counter values and a trace of all ranks is written in finalize()
+  bool trace = false;
+  // the offset of this rank's clock to rank 0's clock, and the time of
+  // init() on rank 0, the start of the trace
+  double clock_offset = 0.0, trace_origin = 0.0;
+  // the start time of the current region from wtime()
+  double region_start = 0.0;
+  std::vector<TraceEvent> trace_events;
+  std::vector<long long> trace_values;
+  // at most trace_limit events are buffered, later events are dropped
+  size_t trace_limit = 0;
+  unsigned long trace_dropped = 0;
+  // region names of the trace, interned by name
+  std::vector<std::string> trace_names;
+  std::unordered_map<std::string,unsigned> trace_name_ids;
+  // the filename for the trace, a json file next to the dump
+  std::string trace_filename;
+  // with PDUMP_MEMORY, page faults and memory usage of each profile are
+  // accumulated as counters and metrics of the region
+  bool memory = false;
+  // /proc/self/statm, kept open to read the resident set size
+  int statm_fd = -1;
+  // tracemalloc's is_tracing, reset_peak and get_traced_memory functions,
+  // Python allocations are counted while tracemalloc is tracing
+  PyObject *tracemalloc[3] = {nullptr, nullptr, nullptr};
+  // the memory usage at the start of the current profile
+  MemoryUsage memory_start;
+};
+
+static PyPerfDumpState *get_state(PyObject *module) {
+  return *static_cast<PyPerfDumpState**>(PyModule_GetState(module));
+}
+
+#ifndef USE_MPI
+// times are relative to when the module was loaded, as seconds since the
+// epoch a double only has a resolution of about 240ns
+static const std::chrono::steady_clock::time_point clock_origin =
+                                          std::chrono::steady_clock::now();
+#endif
+
+/***
+wtime - the wall clock time in seconds, used for runtimes and traces
+***/
+static inline double wtime() {
 #ifdef USE_MPI
-  // when MPI is enabled we will use an MPI function for the runtime
-  static double t_start;
+  return MPI_Wtime();
 #else
-  // when not using MPI we use std::chrono
-  static std::chrono::time_point<std::chrono::high_resolution_clock> t_start;
+  return std::chrono::duration<double, std::ratio<1,1>>(
+    std::chrono::steady_clock::now() - clock_origin).count();
 #endif
-static double runtime;
-// buffer maps counter names to counter values
-static std::unordered_map<std::string,unsigned long long> buffer;
-// the dump function we use is a pointer, set in init()
-static void (*dump)(const int, const int,
-                    const char *const, const char *const,
-                    const PAPIEventSet *const,
-                    std::unordered_map<std::string,unsigned long long> &,
-                    const double);
+}
+
+/***
+Process-wide resources - PAPI is initialized once and shared by all module
+                         states, dumps are serialized since the files (and
+                         HDF5) are shared by every thread and interpreter
+***/
+static std::mutex papi_mutex;
+static int papi_users = 0;
+static std::mutex dump_mutex;
+
+static unsigned long papi_thread_id() {
+  return static_cast<unsigned long>(pthread_self());
+}
+
+static void papi_acquire() {
+  std::lock_guard<std::mutex> lock(papi_mutex);
+  if (papi_users++ == 0) {
+    PAPI_library_init(PAPI_VER_CURRENT);
+    PAPI_thread_init(papi_thread_id);
+  }
+}
+
+static void papi_release() {
+  std::lock_guard<std::mutex> lock(papi_mutex);
+  // let PAPI release resources once it is unused
+  if (--papi_users == 0)
+    PAPI_shutdown();
+}
+
+/***
+dump_record - dump a record with the GIL released so other threads can run
+***/
+static void dump_record(const dump_function dump,
+                        const int rank, const int num_procs,
+                        const std::string &filename,
+                        const char *const region_name,
+                        RegionRecord &record) {
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(dump_mutex);
+    dump(rank, num_procs, filename.c_str(), region_name, record);
+  }
+  Py_END_ALLOW_THREADS
+}
 
 /***
-update_counter_values - adds the values of counters of the event_set to buffer
+dump_lines - append lines to a file with the GIL released
 ***/
-static void update_counter_values() {
+static void dump_lines(const int rank, const int num_procs,
+                        const std::string &filename,
+                        const std::string &lines) {
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(dump_mutex);
+    dumplines(rank, num_procs, filename.c_str(), lines);
+  }
+  Py_END_ALLOW_THREADS
+}
+
+/***
+update_counter_values - adds the values of the current event set to record
+***/
+static void update_counter_values(PyPerfDumpState *st) {
+  const PAPIEventSet *const event_set = st->event_sets[st->current_set];
   size_t i = 0;
   for (const auto &event : event_set->event_names()) {
-    buffer[event] += event_set->values[i++];
+    st->record.counters[event] += event_set->values[i++];
+  }
+}
+
+/***
+extrapolate_counter_values - scale the counters of each event set by the
+                             inverse of its share of the region runtime
+                             and record that share as the set's coverage
+***/
+static void extrapolate_counter_values(PyPerfDumpState *st) {
+  for (size_t i = 0; i < st->event_sets.size(); ++i) {
+    const double coverage = (st->runtime > 0.0)?
+                            st->set_runtime[i] / st->runtime : 0.0;
+    if (coverage > 0.0) {
+      for (const auto &event : st->event_sets[i]->event_names()) {
+        st->record.counters[event] =
+          static_cast<unsigned long long>(st->record.counters[event] / coverage
+                                          + 0.5);
+      }
+    }
+    st->record.metrics["Coverage_" + std::to_string(i+1)] = coverage;
+  }
+}
+
+static inline size_t log2_bin(const unsigned long long value) {
+  return (value == 0)? 0 : 64 - __builtin_clzll(value);
+}
+
+// a peak is a high water mark, its sum over instances has no meaning
+static bool is_peak_metric(const std::string &metric) {
+  return metric == "PeakRSS" || metric == "PyAllocPeak";
+}
+
+/***
+setup_aggregate_names - the names of the aggregate values of each counter
+                        and metric, and the histogram bins if enabled
+***/
+static void setup_aggregate_names(PyPerfDumpState *st) {
+  RegionRecord &aggregate_record = st->aggregate_record;
+  aggregate_record.counter_names.clear();
+  aggregate_record.metric_names.clear();
+  aggregate_record.counter_names.push_back("Count");
+  for (const auto &event : st->record.counter_names) {
+    aggregate_record.counter_names.push_back(event + ":sum");
+    aggregate_record.counter_names.push_back(event + ":min");
+    aggregate_record.counter_names.push_back(event + ":max");
+  }
+  if (st->histogram) {
+    for (const auto &event : st->record.counter_names) {
+      for (size_t b = 0; b < num_bins; ++b)
+        aggregate_record.counter_names.push_back(
+                                      event + ":log2_" + std::to_string(b));
+    }
+    for (size_t b = 0; b < num_bins; ++b)
+      aggregate_record.counter_names.push_back(
+                                      "Runtime:log2ns_" + std::to_string(b));
+  }
+  for (const auto &metric : st->record.metric_names) {
+    if (!is_peak_metric(metric))
+      aggregate_record.metric_names.push_back(metric + ":sum");
+    aggregate_record.metric_names.push_back(metric + ":min");
+    aggregate_record.metric_names.push_back(metric + ":max");
+  }
+}
+
+/***
+aggregate_region - accumulate the record of the current region
+***/
+static void aggregate_region(PyPerfDumpState *st) {
+  RegionRecord &record = st->record;
+  auto it = st->aggregate_ids.find(st->region_name_obj);
+  if (it == st->aggregate_ids.end()) {
+    Py_INCREF(st->region_name_obj);
+    it = st->aggregate_ids.insert(std::make_pair(st->region_name_obj,
+                                            st->aggregates.size())).first;
+    st->aggregates.push_back(RegionAggregate(st->region_name_obj,
+                                              record.counter_names.size(),
+                                              record.metric_names.size(),
+                                              st->histogram));
+  }
+  RegionAggregate &agg = st->aggregates[it->second];
+  ++agg.count;
+  for (size_t i = 0; i < record.counter_names.size(); ++i) {
+    const unsigned long long value = record.counters[record.counter_names[i]];
+    agg.counter_sum[i] += value;
+    agg.counter_min[i] = std::min(agg.counter_min[i], value);
+    agg.counter_max[i] = std::max(agg.counter_max[i], value);
+    if (st->histogram)
+      ++agg.bins[i * num_bins + log2_bin(value)];
+  }
+  for (size_t i = 0; i < record.metric_names.size(); ++i) {
+    const double value = record.metrics[record.metric_names[i]];
+    agg.metric_sum[i] += value;
+    agg.metric_min[i] = std::min(agg.metric_min[i], value);
+    agg.metric_max[i] = std::max(agg.metric_max[i], value);
+  }
+  if (st->histogram) {
+    const unsigned long long ns =
+                static_cast<unsigned long long>(record.metrics["Runtime"]*1e9);
+    ++agg.bins[record.counter_names.size() * num_bins + log2_bin(ns)];
+  }
+}
+
+/***
+flush_aggregates - dump one record per distinct region and release them
+***/
+static void flush_aggregates(const dump_function dump,
+                              const int rank, const int num_procs,
+                              const std::string &filename,
+                              std::vector<RegionAggregate> &aggregates,
+                              RegionRecord &aggregate_record) {
+  // with MPI every write is collective, regions are written in order of
+  // name so every rank writes them in the same order
+  std::sort(aggregates.begin(), aggregates.end(),
+            [](const RegionAggregate &a, const RegionAggregate &b) {
+              return strcmp(PyUnicode_AsUTF8(a.name),
+                            PyUnicode_AsUTF8(b.name)) < 0;
+            });
+  for (auto &agg : aggregates) {
+    // values are set in the same order as setup_aggregate_names()
+    auto name = aggregate_record.counter_names.begin();
+    aggregate_record.counters[*name++] = agg.count;
+    for (size_t i = 0; i < agg.counter_sum.size(); ++i) {
+      aggregate_record.counters[*name++] = agg.counter_sum[i];
+      aggregate_record.counters[*name++] = agg.counter_min[i];
+      aggregate_record.counters[*name++] = agg.counter_max[i];
+    }
+    for (const auto &bin : agg.bins)
+      aggregate_record.counters[*name++] = bin;
+    name = aggregate_record.metric_names.begin();
+    for (size_t i = 0; i < agg.metric_sum.size(); ++i) {
+      // peak metrics have no sum
+      if (name->compare(name->size() - 4, 4, ":sum") == 0)
+        aggregate_record.metrics[*name++] = agg.metric_sum[i];
+      aggregate_record.metrics[*name++] = agg.metric_min[i];
+      aggregate_record.metrics[*name++] = agg.metric_max[i];
+    }
+    dump_record(dump, rank, num_procs, filename,
+                PyUnicode_AsUTF8(agg.name), aggregate_record);
+    Py_DECREF(agg.name);
+  }
+  aggregates.clear();
+}
+
+/***
+env_flag - whether an environment variable is set and isn't "0"
+***/
+static bool env_flag(const char *const name) {
+  const char *env_str = std::getenv(name);
+  return env_str && *env_str != '\0' && strcmp(env_str, "0");
+}
+
+/***
+free_event_sets - delete all event sets and reset the event rotation
+***/
+static void free_event_sets(PyPerfDumpState *st) {
+  for (auto &set : st->event_sets) {
+    delete set;
+  }
+  st->event_sets.clear();
+  st->set_runtime.clear();
+  st->current_set = 0;
+  st->record.counter_names.clear();
+  st->record.metric_names.clear();
+}
+
+/***
+split_list - split a delimiter separated list into its non-empty items
+***/
+static std::vector<std::string> split_list(const char *str,
+                                            const char separator) {
+  std::vector<std::string> items;
+  const char *next;
+  // while we found a delimiter, trim items from the front
+  while ((next = strchr(str, separator))) {
+    if (next != str)
+      items.push_back(std::string(str, next - str));
+    str = next + 1;
+  }
+  // we have exactly 1 item here or the list ended in a delimiter
+  if (*str != '\0')
+    items.push_back(std::string(str));
+  return items;
+}
+
+/***
+Overflow sampling - the PAPI overflow handler runs in a signal context where
+                    only async-signal-safe functions can be used, so it reads
+                    the code object and instruction of the profiled thread's
+                    frame (see frame_sample.h) into a preallocated lock-free
+                    ring of samples, and writes to a pipe to wake a helper
+                    thread when the ring is half full
+                    The samples are resolved to functions and lines with the
+                    GIL held by the helper and when sampling stops, the GIL is
+                    taken with the PyGILState API of the main interpreter so
+                    only the main interpreter of GIL builds is sampled
+                    One profile is sampled at a time in the process
+***/
+static const int max_sampled_events = 64;
+static const size_t sample_ring_size = 4096;
+// a sample of a value of the event set, the code is borrowed, a sample
+// without code and a negative offset couldn't be attributed
+struct RawSample {
+  FrameSample frame;
+  int value;
+};
+static struct {
+  // the state and event set of the profile being sampled
+  std::atomic<PyPerfDumpState*> state;
+  std::atomic<const PAPIEventSet*> event_set;
+  // the profiled thread and its thread state, set before the event set
+  pthread_t thread;
+  PyThreadState *tstate;
+  // samples from tail to head are written by the handler and not resolved
+  RawSample ring[sample_ring_size];
+  std::atomic<size_t> head, tail;
+  // the samples of each value dropped while the ring was full
+  std::atomic<unsigned long> dropped[max_sampled_events];
+  // the handler wakes the helper thread through this pipe
+  int wake_pipe[2];
+} sampler;
+static std::once_flag sampler_once;
+
+/***
+add_samples - add samples of a counter to a function and line of a region
+***/
+static void add_samples(const PyPerfDumpState *st, RegionSamples &samples,
+                        const SampleKey &key, const size_t counter,
+                        const unsigned long count) {
+  auto it = samples.counts.find(key);
+  // a new entry holds a reference to the code object
+  if (it == samples.counts.end()) {
+    Py_XINCREF(key.code);
+    it = samples.counts.insert(std::make_pair(key,
+            std::vector<unsigned long long>(
+              st->record.counter_names.size(), 0))).first;
+  }
+  it->second[counter] += count;
+}
+
+/***
+resolve_samples - add the samples in the ring to the functions and lines
+                  of the current region, called with the GIL held
+***/
+static void resolve_samples(PyPerfDumpState *st) {
+  const std::vector<size_t> &counter_index =
+                                    st->set_counter_index[st->current_set];
+  const size_t num_values = std::min<size_t>(counter_index.size(),
+                                              max_sampled_events);
+  const size_t head = sampler.head.load(std::memory_order_acquire);
+  size_t tail = sampler.tail.load(std::memory_order_relaxed);
+  unsigned long dropped[max_sampled_events];
+  unsigned long total = head - tail;
+  for (size_t i = 0; i < num_values; ++i)
+    total += (dropped[i] = sampler.dropped[i].exchange(0));
+  if (total == 0)
+    return;
+  // the samples of this region
+  auto region = st->region_sample_ids.find(st->region_name_obj);
+  if (region == st->region_sample_ids.end()) {
+    Py_INCREF(st->region_name_obj);
+    region = st->region_sample_ids.insert(std::make_pair(
+                st->region_name_obj, st->region_samples.size())).first;
+    RegionSamples samples;
+    samples.name = st->region_name_obj;
+    st->region_samples.push_back(samples);
+  }
+  RegionSamples &samples = st->region_samples[region->second];
+  // without code the line is 0 outside of Python code, or -1 if the
+  // sample couldn't be attributed
+  const SampleKey unattributed = {nullptr, -1};
+  for (; tail != head; ++tail) {
+    const RawSample &sample = sampler.ring[tail % sample_ring_size];
+    if (static_cast<size_t>(sample.value) >= num_values)
+      continue;
+    SampleKey key = {sample.frame.code, (sample.frame.addr < 0)? -1 : 0};
+    // before Python 3.12 a code object freed before its samples are
+    // resolved is only detected by its type
+    if (key.code && !PyCode_Check(key.code))
+      key = unattributed;
+    else if (key.code)
+      key.line = PyCode_Addr2Line(reinterpret_cast<PyCodeObject*>(key.code),
+                                  sample.frame.addr);
+    add_samples(st, samples, key, counter_index[sample.value], 1);
+  }
+  sampler.tail.store(tail, std::memory_order_release);
+  for (size_t i = 0; i < num_values; ++i) {
+    if (dropped[i])
+      add_samples(st, samples, unattributed, counter_index[i], dropped[i]);
+  }
+}
+
+#if PY_VERSION_HEX >= 0x030C0000
+/***
+forget_code - a code object is freed, its samples that aren't resolved
+              can't be attributed
+***/
+static int forget_code(PyCodeEvent event, PyCodeObject *code) {
+  if (event != PY_CODE_EVENT_DESTROY)
+    return 0;
+  const size_t head = sampler.head.load(std::memory_order_acquire);
+  for (size_t i = sampler.tail.load(); i != head; ++i) {
+    FrameSample &frame = sampler.ring[i % sample_ring_size].frame;
+    if (frame.code == reinterpret_cast<PyObject*>(code)) {
+      frame.code = nullptr;
+      frame.addr = -1;
+    }
+  }
+  return 0;
+}
+#endif
+
+static void overflow_handler(int papi_event_set, void *address,
+                              long long overflow_vector, void *context) {
+  const PAPIEventSet *event_set = sampler.event_set.load();
+  if (!event_set)
+    return;
+  int indices[max_sampled_events];
+  const int count = event_set->overflow_indices(papi_event_set,
+                                                overflow_vector,
+                                                indices, max_sampled_events);
+  if (count <= 0)
+    return;
+  // the frame can only be read on the profiled thread
+  FrameSample frame = {nullptr, -1};
+  if (pthread_equal(pthread_self(), sampler.thread))
+    sample_frame(sampler.tstate, frame);
+  size_t head = sampler.head.load(std::memory_order_relaxed);
+  const size_t tail = sampler.tail.load(std::memory_order_acquire);
+  for (int i = 0; i < count; ++i) {
+    if (indices[i] >= max_sampled_events)
+      continue;
+    // samples are only counted while the ring is full
+    if (head - tail >= sample_ring_size) {
+      sampler.dropped[indices[i]].fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    RawSample &sample = sampler.ring[head++ % sample_ring_size];
+    sample.frame = frame;
+    sample.value = indices[i];
+  }
+  sampler.head.store(head, std::memory_order_release);
+  // wake the helper, if the pipe is full it is already awake
+  if (head - tail >= sample_ring_size / 2) {
+    const int saved_errno = errno;
+    const char wake = 0;
+    if (write(sampler.wake_pipe[1], &wake, 1) < 0) {}
+    errno = saved_errno;
+  }
+}
+
+/***
+sample_helper - the helper thread, resolves samples with the GIL held
+                outside of the signal handler before the ring is full, the
+                profile's state can't end while the GIL is held
+***/
+static void sample_helper() {
+  // overflow signals are handled by the profiled thread
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  char wake[64];
+  for (;;) {
+    const ssize_t len = read(sampler.wake_pipe[0], wake, sizeof(wake));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return;
+    if (!sampler.state.load())
+      continue;
+    const PyGILState_STATE gil = PyGILState_Ensure();
+    PyPerfDumpState *st = sampler.state.load();
+    if (st)
+      resolve_samples(st);
+    PyGILState_Release(gil);
+  }
+}
+
+/***
+start_sample_helper - create the wake pipe and start the helper thread once
+                      in the process, and watch for freed code objects
+***/
+static void start_sample_helper() {
+#if PY_VERSION_HEX >= 0x030C0000
+  if (PyCode_AddWatcher(forget_code) < 0)
+    PyErr_Clear();
+#endif
+  if (pipe(sampler.wake_pipe) != 0) {
+    sampler.wake_pipe[0] = sampler.wake_pipe[1] = -1;
+    return;
+  }
+  fcntl(sampler.wake_pipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(sampler.wake_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sampler.wake_pipe[1], F_SETFD, FD_CLOEXEC);
+  std::thread(sample_helper).detach();
+}
+
+/***
+setup_sampling - set overflow thresholds from PDUMP_OVERFLOW, a list of
+                 EVENT@THRESHOLD items for events in the event sets
+***/
+static void setup_sampling(PyPerfDumpState *st, const char separator) {
+  const std::vector<std::string> &counter_names = st->record.counter_names;
+  st->sample_thresholds.assign(counter_names.size(), 0);
+  st->set_counter_index.clear();
+  for (const auto &set : st->event_sets) {
+    std::vector<size_t> counter_index;
+    for (const auto &event : set->event_names())
+      counter_index.push_back(std::find(counter_names.begin(),
+                                        counter_names.end(), event)
+                              - counter_names.begin());
+    st->set_counter_index.push_back(counter_index);
+  }
+  st->sampling = false;
+  const char *env_str = std::getenv("PDUMP_OVERFLOW");
+  if (!env_str || *env_str == '\0')
+    return;
+  if (!frame_sampling_supported()) {
+    std::fprintf(stderr, "PyPerfDump WARNING: PDUMP_OVERFLOW is not supported"
+                          " in this version of Python, not sampling\n");
+    return;
+  }
+  // samples are resolved by a helper thread that takes the GIL of the
+  // main interpreter, which only serializes it with the module with a GIL
+#ifdef Py_GIL_DISABLED
+  std::fprintf(stderr, "PyPerfDump WARNING: PDUMP_OVERFLOW is not supported"
+                        " in free-threaded builds, not sampling\n");
+  return;
+#endif
+  if (PyThreadState_GetInterpreter(PyThreadState_Get()) !=
+      PyInterpreterState_Main()) {
+    std::fprintf(stderr, "PyPerfDump WARNING: PDUMP_OVERFLOW is only"
+                          " supported in the main interpreter, not sampling\n");
+    return;
+  }
+  std::call_once(sampler_once, start_sample_helper);
+  if (sampler.wake_pipe[1] < 0) {
+    std::fprintf(stderr,
+        "PyPerfDump WARNING: Unable to setup PDUMP_OVERFLOW, not sampling\n");
+    return;
+  }
+  for (const auto &item : split_list(env_str, separator)) {
+    const size_t at = item.rfind('@');
+    const std::string name = item.substr(0, at);
+    const int threshold = (at == std::string::npos)?
+                          0 : atoi(item.c_str() + at + 1);
+    if (threshold <= 0) {
+      std::fprintf(stderr,
+          "PyPerfDump WARNING: No overflow threshold in \"%s\"\n",
+          item.c_str());
+      continue;
+    }
+    bool added = false;
+    for (auto &set : st->event_sets)
+      added = set->overflow(name, threshold, overflow_handler) || added;
+    if (!added) {
+      std::fprintf(stderr,
+          "PyPerfDump WARNING: Not sampling \"%s\"\n", name.c_str());
+      continue;
+    }
+    st->sample_thresholds[std::find(counter_names.begin(),
+                                    counter_names.end(), name)
+                          - counter_names.begin()] = threshold;
+    st->sampling = true;
+  }
+}
+
+/***
+sample_lines - the flat profile of each sampled region as csv lines,
+               functions with the most samples first, releasing the samples
+***/
+static std::string sample_lines(PyPerfDumpState *st) {
+  std::string lines;
+  char linebuffer[256];
+  for (auto &samples : st->region_samples) {
+    const char *region_name = PyUnicode_AsUTF8(samples.name);
+    typedef std::pair<SampleKey,std::vector<unsigned long long>> Entry;
+    std::vector<Entry> entries(samples.counts.begin(), samples.counts.end());
+    std::vector<unsigned long long> totals;
+    for (const auto &entry : entries) {
+      unsigned long long total = 0;
+      for (const auto &count : entry.second)
+        total += count;
+      totals.push_back(total);
+    }
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&totals](const size_t a, const size_t b) {
+                return totals[a] > totals[b];
+              });
+    for (const auto &i : order) {
+      const SampleKey &key = entries[i].first;
+      // the function is the filename and qualified name of the code
+      std::string function = (key.line < 0)? "<unattributed>" : "<native>";
+      if (key.code) {
+        PyObject *filename = PyObject_GetAttrString(key.code, "co_filename");
+        PyObject *qualname = PyObject_GetAttrString(key.code, "co_qualname");
+        if (!qualname) {
+          PyErr_Clear();
+          qualname = PyObject_GetAttrString(key.code, "co_name");
+        }
+        if (filename && qualname) {
+          function = std::string(PyUnicode_AsUTF8(filename)) + ":" +
+                      PyUnicode_AsUTF8(qualname);
+        }
+        PyErr_Clear();
+        Py_XDECREF(filename);
+        Py_XDECREF(qualname);
+      }
+      const std::vector<std::string> &names = st->record.counter_names;
+      for (size_t c = 0; c < names.size(); ++c) {
+        if (entries[i].second[c] == 0)
+          continue;
+        // the count of events is estimated from the overflow threshold
+#ifdef USE_MPI
+        snprintf(linebuffer, 256, "%d,", st->rank);
+        lines += linebuffer;
+#endif
+        snprintf(linebuffer, 256, ",%d,%s,%llu,%llu\n",
+                  std::max(key.line, 0), names[c].c_str(),
+                  entries[i].second[c],
+                  entries[i].second[c] * st->sample_thresholds[c]);
+        lines += std::string(region_name) + "," + function + linebuffer;
+      }
+      Py_XDECREF(key.code);
+    }
+    Py_DECREF(samples.name);
+  }
+  st->region_samples.clear();
+  st->region_sample_ids.clear();
+  return lines;
+}
+
+/***
+release_samples - release the samples without writing them
+***/
+static void release_samples(PyPerfDumpState *st) {
+  for (auto &samples : st->region_samples) {
+    for (auto &count : samples.counts)
+      Py_XDECREF(count.first.code);
+    Py_DECREF(samples.name);
+  }
+  st->region_samples.clear();
+  st->region_sample_ids.clear();
+}
+
+/***
+start_sampling - sample the current event set in this thread if no other
+                 profile in the process is sampled
+***/
+static void start_sampling(PyPerfDumpState *st) {
+  PyPerfDumpState *sampled = nullptr;
+  if (st->sampling && sampler.state.compare_exchange_strong(sampled, st)) {
+    sampler.thread = pthread_self();
+    sampler.tstate = PyThreadState_Get();
+    sampler.event_set.store(st->event_sets[st->current_set]);
+  }
+}
+
+/***
+stop_sampling - stop attributing samples to this state's profile
+***/
+static void stop_sampling(PyPerfDumpState *st) {
+  if (sampler.state.load() != st)
+    return;
+  sampler.event_set.store(nullptr);
+  // resolve the samples taken before the counters were stopped
+  resolve_samples(st);
+  sampler.state.store(nullptr);
+}
+
+/***
+setup_memory - add the memory counters and metrics to the record
+***/
+static void setup_memory(PyPerfDumpState *st) {
+  st->record.counter_names.push_back("MinorFaults");
+  st->record.counter_names.push_back("MajorFaults");
+  st->record.metric_names.push_back("RSSDelta");
+  st->record.metric_names.push_back("PeakRSS");
+  st->record.metric_names.push_back("PyAllocDelta");
+  st->record.metric_names.push_back("PyAllocPeak");
+  // the resident set size is only available on Linux
+  st->statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  PyObject *module = PyImport_ImportModule("tracemalloc");
+  static const char *functions[] = {"is_tracing", "reset_peak",
+                                    "get_traced_memory"};
+  for (int i = 0; module && i < 3; ++i) {
+    if (!(st->tracemalloc[i] = PyObject_GetAttrString(module, functions[i])))
+      break;
+  }
+  // without tracemalloc or reset_peak Python allocations aren't counted
+  if (!module || !st->tracemalloc[2]) {
+    PyErr_Clear();
+    for (auto &function : st->tracemalloc)
+      Py_CLEAR(function);
+  }
+  Py_XDECREF(module);
+}
+
+static void release_memory(PyPerfDumpState *st) {
+  if (st->statm_fd >= 0)
+    close(st->statm_fd);
+  st->statm_fd = -1;
+  for (auto &function : st->tracemalloc)
+    Py_CLEAR(function);
+  st->memory = false;
+}
+
+/***
+read_memory - the current memory usage, at the start of a profile the peak
+              traced by tracemalloc is reset to the current traced memory
+              and at the end tracemalloc is read if it was tracing at the
+              start
+***/
+static void read_memory(const PyPerfDumpState *st, MemoryUsage &usage,
+                        const MemoryUsage *start) {
+  struct rusage ru;
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &ru);
+#else
+  getrusage(RUSAGE_SELF, &ru);
+#endif
+  usage.thread = pthread_self();
+  usage.minor_faults = ru.ru_minflt;
+  usage.major_faults = ru.ru_majflt;
+#ifdef RUSAGE_THREAD
+  // the faults of different threads can't be compared, a profile ended on
+  // another thread than it started on counts no faults
+  if (start && !pthread_equal(start->thread, usage.thread)) {
+    usage.minor_faults = start->minor_faults;
+    usage.major_faults = start->major_faults;
+  }
+#endif
+  // the high water mark of the process in kilobytes
+  usage.peak_rss = ru.ru_maxrss * 1024LL;
+  usage.rss = 0;
+  if (st->statm_fd >= 0) {
+    // the second field is the number of resident pages
+    char buffer[128];
+    const ssize_t len = pread(st->statm_fd, buffer, sizeof(buffer) - 1, 0);
+    if (len > 0) {
+      buffer[len] = '\0';
+      char *next;
+      strtoll(buffer, &next, 10);
+      usage.rss = strtoll(next, nullptr, 10) * sysconf(_SC_PAGESIZE);
+    }
+  }
+  usage.py_current = usage.py_peak = 0;
+  usage.py_traced = false;
+  if (!st->tracemalloc[0])
+    return;
+  PyObject *result;
+  if (start)
+    usage.py_traced = start->py_traced;
+  else {
+    result = PyObject_CallNoArgs(st->tracemalloc[0]);
+    usage.py_traced = result && PyObject_IsTrue(result) == 1;
+    Py_XDECREF(result);
+    if (usage.py_traced) {
+      result = PyObject_CallNoArgs(st->tracemalloc[1]);
+      Py_XDECREF(result);
+    }
   }
+  if (usage.py_traced) {
+    result = PyObject_CallNoArgs(st->tracemalloc[2]);
+    if (!result || !PyArg_ParseTuple(result, "LL", &usage.py_current,
+                                      &usage.py_peak))
+      usage.py_traced = false;
+    Py_XDECREF(result);
+  }
+  PyErr_Clear();
+}
+
+/***
+add_memory_usage - accumulate the memory usage of a profile into record,
+                   deltas are summed and peaks are the maximum
+***/
+static void add_memory_usage(const MemoryUsage &start, const MemoryUsage &end,
+                              RegionRecord &record) {
+  record.counters["MinorFaults"] += end.minor_faults - start.minor_faults;
+  record.counters["MajorFaults"] += end.major_faults - start.major_faults;
+  record.metrics["RSSDelta"] += end.rss - start.rss;
+  record.metrics["PeakRSS"] = std::max(record.metrics["PeakRSS"],
+                                        static_cast<double>(end.peak_rss));
+  if (!end.py_traced)
+    return;
+  record.metrics["PyAllocDelta"] += end.py_current - start.py_current;
+  // the traced peak above the traced memory at the start of the profile
+  record.metrics["PyAllocPeak"] = std::max(record.metrics["PyAllocPeak"],
+                          static_cast<double>(end.py_peak - start.py_current));
+}
+
+/***
+Tracing - regions and profiles are buffered in memory with times of this
+          rank's clock, at init() the offset of each rank's clock to rank 0
+          is estimated and at finalize() all ranks write one Chrome trace
+***/
+// events of a rank buffered without PDUMP_TRACE_LIMIT, a few hundred bytes
+// of memory and of the trace each
+static const size_t default_trace_limit = 1000000;
+// round trips with rank 0 to estimate a rank's clock offset
+static const int clock_rounds = 8;
+static const int clock_tag = 0x5044;
+
+/***
+align_clocks - estimate this rank's clock offset to rank 0 from the round
+               trip with the least latency, Cristian's algorithm, and set
+               the trace origin to rank 0's current time
+***/
+static void align_clocks(PyPerfDumpState *st) {
+#ifdef USE_MPI
+  double offset = 0.0;
+  if (st->rank == 0) {
+    // answer each rank in turn with rank 0's time
+    for (int r = 1; r < st->num_procs; ++r) {
+      for (int i = 0; i < clock_rounds; ++i) {
+        double t;
+        MPI_Recv(&t, 1, MPI_DOUBLE, r, clock_tag, MPI_COMM_WORLD,
+                  MPI_STATUS_IGNORE);
+        t = MPI_Wtime();
+        MPI_Send(&t, 1, MPI_DOUBLE, r, clock_tag, MPI_COMM_WORLD);
+      }
+    }
+  }
+  else {
+    double min_rtt = std::numeric_limits<double>::max();
+    for (int i = 0; i < clock_rounds; ++i) {
+      const double t0 = MPI_Wtime();
+      double t_root;
+      MPI_Send(&t0, 1, MPI_DOUBLE, 0, clock_tag, MPI_COMM_WORLD);
+      MPI_Recv(&t_root, 1, MPI_DOUBLE, 0, clock_tag, MPI_COMM_WORLD,
+                MPI_STATUS_IGNORE);
+      const double t1 = MPI_Wtime();
+      // rank 0's time is assumed to be read halfway through the round trip
+      if (t1 - t0 < min_rtt) {
+        min_rtt = t1 - t0;
+        offset = t_root - (t0 + t1) / 2.0;
+      }
+    }
+  }
+  st->clock_offset = offset;
+  st->trace_origin = MPI_Wtime();
+  MPI_Bcast(&st->trace_origin, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#else
+  st->clock_offset = 0.0;
+  st->trace_origin = wtime();
+#endif
+}
+
+/***
+trace_event - buffer a region (set = -1) or a profile and its counter values
+***/
+static void trace_event(PyPerfDumpState *st, const double start,
+                        const double duration, const int set,
+                        const long long *values) {
+  if (st->trace_events.size() >= st->trace_limit) {
+    ++st->trace_dropped;
+    return;
+  }
+  const char *name = PyUnicode_AsUTF8(st->region_name_obj);
+  auto it = st->trace_name_ids.find(name);
+  if (it == st->trace_name_ids.end()) {
+    it = st->trace_name_ids.insert(std::make_pair(std::string(name),
+                                            st->trace_names.size())).first;
+    st->trace_names.push_back(name);
+  }
+  const TraceEvent event = {start, duration, it->second, set,
+                            st->trace_values.size()};
+  st->trace_events.push_back(event);
+  if (set >= 0) {
+    st->trace_values.insert(st->trace_values.end(), values,
+                          values + st->event_sets[set]->event_names().size());
+  }
+}
+
+/***
+json_string - a string as a quoted JSON string
+***/
+static std::string json_string(const std::string &str) {
+  std::string quoted = "\"";
+  char escape[8];
+  for (const char &c : str) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20) {
+      snprintf(escape, 8, "\\u%04x", c);
+      quoted += escape;
+    }
+    else
+      quoted += c;
+  }
+  return quoted + "\"";
+}
+
+/***
+trace_lines - this rank's part of the trace in the Chrome trace event format,
+              rank 0 begins the trace and the last rank ends it, the
+              events are released
+***/
+static std::string trace_lines(PyPerfDumpState *st) {
+  std::string lines;
+  char linebuffer[256];
+  // each rank is a process named by its rank
+  snprintf(linebuffer, 256,
+            "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":0,\"args\":{\"name\":\"rank %d\"}}",
+            (st->rank == 0)? "{\"traceEvents\":[\n" : ",\n",
+            st->rank, st->rank);
+  lines += linebuffer;
+  // timestamps are microseconds of rank 0's clock since the origin
+  const double origin = st->trace_origin - st->clock_offset;
+  for (const auto &event : st->trace_events) {
+    snprintf(linebuffer, 256,
+              ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":0",
+              (event.set < 0)? "region" : "profile",
+              (event.start - origin) * 1e6, event.duration * 1e6, st->rank);
+    lines += ",\n{\"name\":" + json_string(st->trace_names[event.name]) +
+              linebuffer;
+    // the args of a profile are its event set and counter values
+    if (event.set >= 0) {
+      snprintf(linebuffer, 256, ",\"args\":{\"set\":%d", event.set + 1);
+      lines += linebuffer;
+      size_t i = event.values;
+      for (const auto &name : st->event_sets[event.set]->event_names()) {
+        snprintf(linebuffer, 256, ":%lld", st->trace_values[i++]);
+        lines += "," + json_string(name) + linebuffer;
+      }
+      lines += "}";
+    }
+    lines += "}";
+  }
+  if (st->rank == st->num_procs - 1)
+    lines += "\n]}\n";
+  if (st->trace_dropped) {
+    std::fprintf(stderr, "PyPerfDump WARNING: Rank %d dropped %lu trace events"
+                          " beyond PDUMP_TRACE_LIMIT=%zu\n",
+                  st->rank, st->trace_dropped, st->trace_limit);
+  }
+  st->trace_dropped = 0;
+  st->trace_events.clear();
+  st->trace_values.clear();
+  st->trace_names.clear();
+  st->trace_name_ids.clear();
+  return lines;
+}
+
+/***
+write_trace - replace the trace file with the trace of all ranks, called
+              collectively by all ranks with the GIL released
+***/
+static void write_trace(const int rank, const int num_procs,
+                        const std::string &filename,
+                        const std::string &lines) {
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(dump_mutex);
+    // the trace is one JSON document, any previous trace is removed
+    if (rank == 0)
+      std::remove(filename.c_str());
+#ifdef USE_MPI
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+    dumplines(rank, num_procs, filename.c_str(), lines);
+  }
+  Py_END_ALLOW_THREADS
+}
+
+/***
+begin_region - hold the interned region name, a generic name if name is null
+***/
+static bool begin_region(PyPerfDumpState *st, PyObject *name) {
+  // increment region count every time regardless, used in generic names
+  ++st->region_count;
+  if (name)
+    Py_INCREF(name);
+  else if (!(name = PyUnicode_FromFormat("region_%d", st->region_count)))
+    return false;
+  // interned names are unique objects, used as keys for aggregation
+  PyUnicode_InternInPlace(&name);
+  st->region_name_obj = name;
+  st->runtime = 0.0;
+  st->region_start = wtime();
+  return true;
+}
+
+/***
+median - the median of values, values are reordered
+***/
+static double median(std::vector<double> &values) {
+  if (values.empty())
+    return 0.0;
+  const size_t mid = values.size() / 2;
+  std::nth_element(values.begin(), values.begin() + mid, values.end());
+  double value = values[mid];
+  // with an even number of values average the two middle values
+  if (values.size() % 2 == 0)
+    value = (value + *std::max_element(values.begin(),
+                                        values.begin() + mid)) / 2.0;
+  return value;
+}
+
+/***
+measure_stats - the median, min and median absolute deviation of samples,
+                samples are overwritten
+***/
+static void measure_stats(std::vector<double> &samples, double stats[3]) {
+  stats[1] = (samples.empty())?
+              0.0 : *std::min_element(samples.begin(), samples.end());
+  stats[0] = median(samples);
+  for (auto &sample : samples)
+    sample = std::fabs(sample - stats[0]);
+  stats[2] = median(samples);
 }
 
 /***
 PyPerfDump
 ***/
-// an error object to raise exceptions
-static PyObject *PyPerfDumpError;
+// In free-threaded builds the methods of a module are serialized with a
+// critical section on the module, which is suspended while a dump runs
+#if PY_VERSION_HEX >= 0x030D0000
+  #define PD_BEGIN_LOCK(obj) Py_BEGIN_CRITICAL_SECTION(obj)
+  #define PD_END_LOCK Py_END_CRITICAL_SECTION()
+#else
+  #define PD_BEGIN_LOCK(obj) {
+  #define PD_END_LOCK }
+#endif
+// method_name locks the module and calls name_impl with the module state
+#define PD_METHOD(name)                                             \
+  static PyObject *name##_impl(PyPerfDumpState *st,                 \
+                                PyObject *self, PyObject *args);    \
+  static PyObject *method_##name(PyObject *self, PyObject *args) {  \
+    PyObject *result;                                               \
+    PD_BEGIN_LOCK(self)                                             \
+    result = name##_impl(get_state(self), self, args);              \
+    PD_END_LOCK                                                     \
+    return result;                                                  \
+  }
+// methods with keyword arguments also pass the keywords to name_impl
+#define PD_METHOD_KW(name)                                          \
+  static PyObject *name##_impl(PyPerfDumpState *st, PyObject *self, \
+                                PyObject *args, PyObject *kwargs);  \
+  static PyObject *method_##name(PyObject *self, PyObject *args,    \
+                                  PyObject *kwargs) {               \
+    PyObject *result;                                               \
+    PD_BEGIN_LOCK(self)                                             \
+    result = name##_impl(get_state(self), self, args, kwargs);      \
+    PD_END_LOCK                                                     \
+    return result;                                                  \
+  }
 // the module methods
-static PyObject *method_init(PyObject *self,PyObject *args);
-static PyObject *method_start_region(PyObject *self,PyObject *args);
-static PyObject *method_start_profile(PyObject *self,PyObject *args);
-static PyObject *method_end_profile(PyObject *self,PyObject *args);
-static PyObject *method_end_region(PyObject *self, PyObject *args);
-static PyObject *method_finalize(PyObject *self,PyObject *args);
+PD_METHOD(init)
+PD_METHOD(start_region)
+PD_METHOD(start_profile)
+PD_METHOD(end_profile)
+PD_METHOD(end_region)
+PD_METHOD_KW(measure)
+PD_METHOD(finalize)
 static PyMethodDef pyperfdumpMethods[] = {
   { "init", method_init, METH_VARARGS,
     "Init PyPerfDump"},
@@ -104,10 +1275,90 @@ static PyMethodDef pyperfdumpMethods[] = {
     "End counter collection"},
   { "end_region", method_end_region, METH_VARARGS,
     "End a region"},
+  { "measure", (PyCFunction)(void(*)(void))method_measure,
+    METH_VARARGS | METH_KEYWORDS,
+    "Measure a callable as a region, returns statistics per counter"},
   { "finalize", method_finalize, METH_VARARGS,
     "Finalize PyPerfDump"},
   {NULL, NULL, 0, NULL}
 };
+
+/***
+pyperfdump_exec - create the module state of a new module object
+***/
+static int pyperfdump_exec(PyObject *m) {
+  PyPerfDumpState *st = new PyPerfDumpState();
+  *static_cast<PyPerfDumpState**>(PyModule_GetState(m)) = st;
+  st->error = PyErr_NewException("pyperfdump.error", NULL, NULL);
+  if (st->error == NULL)
+    return -1;
+  if (PyModule_AddObjectRef(m, "error", st->error) < 0)
+    return -1;
+  return 0;
+}
+
+static int pyperfdump_traverse(PyObject *m, visitproc visit, void *arg) {
+  PyPerfDumpState *st = get_state(m);
+  if (st) {
+    Py_VISIT(st->error);
+    Py_VISIT(st->region_name_obj);
+    for (const auto &function : st->tracemalloc)
+      Py_VISIT(function);
+    for (const auto &agg : st->aggregates)
+      Py_VISIT(agg.name);
+  }
+  return 0;
+}
+
+static int pyperfdump_clear(PyObject *m) {
+  PyPerfDumpState *st = get_state(m);
+  if (st)
+    Py_CLEAR(st->error);
+  return 0;
+}
+
+/***
+pyperfdump_free - release the module state, a module that wasn't finalized
+                  releases its resources without writing aggregates
+***/
+static void pyperfdump_free(void *m) {
+  PyPerfDumpState *st = get_state(static_cast<PyObject*>(m));
+  if (!st)
+    return;
+  pyperfdump_clear(static_cast<PyObject*>(m));
+  if (st->current_state != PD_NOTSTARTED) {
+    if (sampler.state.load() == st) {
+      sampler.event_set.store(nullptr);
+      sampler.tail.store(sampler.head.load());
+      for (auto &dropped : sampler.dropped)
+        dropped.store(0);
+      sampler.state.store(nullptr);
+    }
+    release_samples(st);
+    release_memory(st);
+    Py_CLEAR(st->region_name_obj);
+    for (auto &agg : st->aggregates)
+      Py_DECREF(agg.name);
+    free_event_sets(st);
+    papi_release();
+  }
+  delete st;
+  *static_cast<PyPerfDumpState**>(PyModule_GetState(
+                                    static_cast<PyObject*>(m))) = nullptr;
+}
+
+static PyModuleDef_Slot pyperfdumpSlots[] = {
+  {Py_mod_exec, (void*)pyperfdump_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+  // each interpreter has its own module state
+  {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+  // module state is protected by critical sections in free-threaded builds
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+  {0, NULL}
+};
 static struct PyModuleDef pyperfdumpmodule = {
   PyModuleDef_HEAD_INIT,
   "pyperfdump",
@@ -124,19 +1375,15 @@ static struct PyModuleDef pyperfdumpmodule = {
     "PyPerfDump for PAPI",
   #endif
 #endif
-  -1,
-  pyperfdumpMethods
+  sizeof(PyPerfDumpState*),
+  pyperfdumpMethods,
+  pyperfdumpSlots,
+  pyperfdump_traverse,
+  pyperfdump_clear,
+  pyperfdump_free
 };
 PyMODINIT_FUNC PyInit_pyperfdump(void) {
-  PyObject *m = PyModule_Create(&pyperfdumpmodule);
-  if (m == NULL) return NULL;
-  PyPerfDumpError = PyErr_NewException("pyperfdump.error", NULL, NULL);
-  if (PyModule_AddObjectRef(m, "error", PyPerfDumpError) < 0) {
-    Py_CLEAR(PyPerfDumpError);
-    Py_DECREF(m);
-    return NULL;
-  }
-  return m;
+  return PyModuleDef_Init(&pyperfdumpmodule);
 }
 
 /***
@@ -144,7 +1391,8 @@ break_state - adds the current state onto a (warning/error) message
               if iserror = true:  raise a PyPerfDumpError
               else:               print the warning message
 ***/
-static PyObject *break_state(std::string msg, const bool iserror) {
+static PyObject *break_state(const PyPerfDumpState *st,
+                              std::string msg, const bool iserror) {
   if (iserror) {
     msg = "PyPerfDump ERROR: " + msg;
   }
@@ -156,7 +1404,7 @@ static PyObject *break_state(std::string msg, const bool iserror) {
 #endif
   }
   msg += "\nPyPerfDump STATE: ";
-  switch(current_state) {
+  switch(st->current_state) {
     case PD_NOTSTARTED:
       msg += "Not initialized";
       break;
@@ -166,80 +1414,134 @@ static PyObject *break_state(std::string msg, const bool iserror) {
     case PD_INREGION:
       msg += "Initialized and within a region, not profiling";
       break;
-    default: // case PD_INPROFILE:
+    case PD_INPROFILE:
       msg += "Initialized and profiling within a region";
       break;
+    default: // case PD_INMEASURE:
+      msg += "Initialized and measuring a callable";
+      break;
   }
   if (iserror)
-    PyErr_SetString(PyPerfDumpError, msg.c_str());
+    PyErr_SetString(st->error, msg.c_str());
   else
     std::fprintf(stderr, "%s\n", msg.c_str());
   Py_RETURN_NONE;
 }
 
 /***
-method_init - initialize PyPerfDump and PAPI
+init - initialize PyPerfDump and PAPI
 ***/
-static PyObject *method_init(PyObject *self,PyObject *args) {
+static PyObject *init_impl(PyPerfDumpState *st,
+                            PyObject *self, PyObject *args) {
   // warn and return if we are already initialized
-  if (current_state != PD_NOTSTARTED)
-    return break_state("Already initialized", false);
+  if (st->current_state != PD_NOTSTARTED)
+    return break_state(st, "Already initialized", false);
 #ifdef USE_MPI
   // get rank and number of processes
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+  MPI_Comm_rank(MPI_COMM_WORLD, &st->rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &st->num_procs);
 #endif
   // initialize PAPI
-  PAPI_library_init(PAPI_VER_CURRENT);
-  event_set = (PAPIEventSet*) new PAPIEventSet();
+  papi_acquire();
+  RegionRecord &record = st->record;
+  std::vector<PAPIEventSet*> &event_sets = st->event_sets;
   // char pointer for getenv
   char *env_str;
-  // get counters by name with PDUMP_EVENTS
-  if ((env_str = std::getenv("PDUMP_EVENTS")) && *env_str != '\0') {
-    std::vector<std::string> env_event_names;
-    // allow for either user-defined or comma separated list
-    char *next = std::getenv("PDUMP_DELIMITER");
-    const char separator = (next)? *next : ',';
-    // while we found a delimiter, trim words from the front
-    while (*env_str != '\0' && (next=strchr(env_str, separator))) {
-      // set the delimiter to null
-      *next = '\0';
-      // add the next name
-      env_event_names.push_back(std::string(env_str));
-      // put the string start at the delimiter + 1
-      env_str = next+1;
+  // allow for either user-defined or comma separated lists
+  env_str = std::getenv("PDUMP_DELIMITER");
+  const char separator = (env_str)? *env_str : ',';
+  // get groups of counters by name with PDUMP_EVENT_GROUPS
+  if ((env_str = std::getenv("PDUMP_EVENT_GROUPS")) && *env_str != '\0') {
+    // allow for either user-defined or semicolon separated groups
+    char *next = std::getenv("PDUMP_GROUP_DELIMITER");
+    const char group_separator = (next)? *next : ';';
+    for (const auto &group : split_list(env_str, group_separator)) {
+      std::vector<std::string> group_event_names;
+      for (const auto &name : split_list(group.c_str(), separator)) {
+        // each event can only be counted by one group
+        if (std::find(record.counter_names.begin(),
+                      record.counter_names.end(), name)
+              != record.counter_names.end() ||
+            std::find(group_event_names.begin(),
+                      group_event_names.end(), name)
+              != group_event_names.end()) {
+          std::fprintf(stderr,
+                "PyPerfDump WARNING: Skipping duplicate event \"%s\"\n",
+                name.c_str());
+          continue;
+        }
+        group_event_names.push_back(name);
+      }
+      // each group is a separate event set, skip groups with no valid event
+      PAPIEventSet *group_set = new PAPIEventSet();
+      if (group_set->add_from_names(group_event_names) == 0) {
+        delete group_set;
+        continue;
+      }
+      event_sets.push_back(group_set);
+      record.counter_names.insert(record.counter_names.end(),
+                                  group_set->event_names().begin(),
+                                  group_set->event_names().end());
+    }
+    // if we couldn't add any group from these names break and raise error
+    if (event_sets.empty()) {
+      free_event_sets(st);
+      papi_release();
+      return break_state(st, "No valid event in PDUMP_EVENT_GROUPS", true);
     }
-    // we have exactly 1 name to add here or the list ended in a delimiter
-    if (*env_str != '\0')
-      env_event_names.push_back(std::string(env_str));
+  }
+  // or get counters by name with PDUMP_EVENTS
+  else if ((env_str = std::getenv("PDUMP_EVENTS")) && *env_str != '\0') {
+    event_sets.push_back(new PAPIEventSet());
+    std::vector<std::string> env_event_names = split_list(env_str, separator);
     // if we couldn't add any event from these names break and raise error
-    if (event_set->add_from_names(env_event_names) == 0)
-      return break_state("No valid event in PDUMP_EVENTS", true);
+    if (event_sets[0]->add_from_names(env_event_names) == 0) {
+      free_event_sets(st);
+      papi_release();
+      return break_state(st, "No valid event in PDUMP_EVENTS", true);
+    }
   }
   // or get counters by value with PDUMP_CODES
   else if ((env_str = std::getenv("PDUMP_CODES")) && *env_str != '\0') {
+    event_sets.push_back(new PAPIEventSet());
     std::vector<int> env_event_codes;
-    // allow for either user-defined or comma separated list
-    char *next = std::getenv("PDUMP_DELIMITER");
-    const char separator = (next)? *next : ',';
-    // while we found a delimiter, trim words from the front
-    while (*env_str != '\0' && (next=strchr(env_str, separator))) {
-      *next = '\0';
-      // add the next code
-      env_event_codes.push_back(atoi(env_str));
-      // put the string start at delimiter + 1
-      env_str = next+1;
-    }
-    // we have exactly 1 name to add here or the list ended in a delimiter
-    if (*env_str != '\0')
-      env_event_codes.push_back(atoi(env_str));
+    for (const auto &code : split_list(env_str, separator))
+      env_event_codes.push_back(atoi(code.c_str()));
     // if we couldn't add any event from these codes break and raise error
-    if (event_set->add_from_codes(env_event_codes) == 0)
-      return break_state("No valid code in PDUMP_CODES", true);
+    if (event_sets[0]->add_from_codes(env_event_codes) == 0) {
+      free_event_sets(st);
+      papi_release();
+      return break_state(st, "No valid code in PDUMP_CODES", true);
+    }
   }
   // fail if no counters were given
-  else
-    return break_state("Neither PDUMP_EVENTS nor PDUMP_CODES is set", true);
+  else {
+    papi_release();
+    return break_state(st,
+      "None of PDUMP_EVENT_GROUPS, PDUMP_EVENTS, or PDUMP_CODES is set", true);
+  }
+  // with a single event set the counter names are the event set's names
+  if (event_sets.size() == 1)
+    record.counter_names = event_sets[0]->event_names();
+  // with event rotation each event set's coverage of the region is recorded
+  else {
+    for (size_t i = 0; i < event_sets.size(); ++i)
+      record.metric_names.push_back("Coverage_" + std::to_string(i+1));
+  }
+  record.metric_names.push_back("Runtime");
+  st->set_runtime.assign(event_sets.size(), 0.0);
+  st->event_thread = pthread_self();
+  // collect page faults and memory usage of profiles with PDUMP_MEMORY
+  if ((st->memory = env_flag("PDUMP_MEMORY")))
+    setup_memory(st);
+  // sample events on counter overflow with PDUMP_OVERFLOW
+  setup_sampling(st, separator);
+  // aggregate completed regions by name rather than dumping each instance
+  st->aggregate = env_flag("PDUMP_AGGREGATE");
+  st->histogram = st->aggregate && env_flag("PDUMP_HISTOGRAM");
+  if (st->aggregate)
+    setup_aggregate_names(st);
+  std::string &filename = st->filename;
   // setup our output filename, begin with the directory
   if ((env_str = std::getenv("PDUMP_DUMP_DIR")) && *env_str != '\0') {
     filename = std::string(env_str);
@@ -253,134 +1555,328 @@ static PyObject *method_init(PyObject *self,PyObject *args) {
     filename += std::string(env_str);
   else
     filename += "perf_dump";
+  // samples are always csv
+  st->sample_filename = filename + ".samples.csv";
+  // record a timeline of regions and profiles with PDUMP_TRACE
+  st->trace = env_flag("PDUMP_TRACE");
+  st->trace_filename = filename + ".trace.json";
+  // the trace is buffered until finalize, limit the events of each rank
+  st->trace_limit = default_trace_limit;
+  if ((env_str = std::getenv("PDUMP_TRACE_LIMIT")) && *env_str != '\0')
+    st->trace_limit = strtoull(env_str, nullptr, 10);
+  if (st->trace)
+    align_clocks(st);
 #ifdef ENABLE_HDF5
   // if we have HDF5 enabled, determine whether we should do csv or hdf5
   env_str = std::getenv("PDUMP_OUTPUT_FORMAT");
   if (env_str && (!strcmp(env_str, "CSV") || !strcmp(env_str, "csv"))) {
-    dump = dumpcsv;
+    st->dump = dumpcsv;
     filename += ".csv";
   }
   else {
-    dump = dumphdf5;
+    st->dump = dumphdf5;
   #ifdef USE_MPI
     // The number of processes affects the dimensionality of HDF5 files
     // use the number of ranks in the end of the filename to prevent issues
-    filename += "." + std::to_string(num_procs) + ".h5";
+    filename += "." + std::to_string(st->num_procs) + ".h5";
   #else
     filename += ".h5";
   #endif
   }
 #else
   // if HDF5 is not enabled then we will dump csv
-  dump = dumpcsv;
+  st->dump = dumpcsv;
   filename += ".csv";
 #endif
   // move state to initialized and increment our reference count
-  current_state = PD_LIBINIT;
+  st->current_state = PD_LIBINIT;
   Py_INCREF(self);
   Py_RETURN_NONE;
 }
 
-static PyObject *method_start_region(PyObject *self,PyObject *args) {
+static PyObject *start_region_impl(PyPerfDumpState *st,
+                                    PyObject *self, PyObject *args) {
   // we are either not initialized or are already within a region
-  if (current_state != PD_LIBINIT) {
-    return break_state("Cannot start a region here", false);
-  }
-  // increment region count every time regardless, used in generic_region_name
-  ++region_count;
-  if (!PyArg_ParseTuple(args,"|s",&region_name)) {
-    generic_region_name = new char[32];
-    region_name = generic_region_name;
-    snprintf(region_name,32,"region_%d",region_count);
-  }
-  runtime = 0.0;
-  current_state = PD_INREGION;
+  if (st->current_state != PD_LIBINIT) {
+    return break_state(st, "Cannot start a region here", false);
+  }
+  PyObject *name = nullptr;
+  // use a generic name if a name isn't given or isn't a string
+  if (!PyArg_ParseTuple(args, "|U", &name)) {
+    PyErr_Clear();
+    name = nullptr;
+  }
+  if (!begin_region(st, name))
+    return NULL;
+  st->current_state = PD_INREGION;
   Py_RETURN_NONE;
 }
 
-static PyObject *method_start_profile(PyObject *self,PyObject *args) {
+/***
+own_event_sets - create the event sets again on the calling thread if it
+                 isn't the thread that created them, so PAPI counts it
+***/
+static void own_event_sets(PyPerfDumpState *st) {
+  const pthread_t thread = pthread_self();
+  if (pthread_equal(st->event_thread, thread))
+    return;
+  for (auto &set : st->event_sets)
+    set->recreate();
+  st->event_thread = thread;
+}
+
+static PyObject *start_profile_impl(PyPerfDumpState *st,
+                                    PyObject *self, PyObject *args) {
   // we aren't initialized, not within a region, or are already profiling
-  if (current_state != PD_INREGION) {
-    return break_state("Cannot start profiling here", false);
+  if (st->current_state != PD_INREGION) {
+    return break_state(st, "Cannot start profiling here", false);
   }
-#ifdef USE_MPI
-  t_start = MPI_Wtime();
-#else
-  t_start = std::chrono::high_resolution_clock::now();
-#endif
-  event_set->start();
-  current_state = PD_INPROFILE;
+  own_event_sets(st);
+  if (st->memory)
+    read_memory(st, st->memory_start, nullptr);
+  st->t_start = wtime();
+  start_sampling(st);
+  st->event_sets[st->current_set]->start();
+  st->current_state = PD_INPROFILE;
   Py_RETURN_NONE;
 }
 
-static PyObject *method_end_profile(PyObject *self,PyObject *args) {
+static PyObject *end_profile_impl(PyPerfDumpState *st,
+                                  PyObject *self, PyObject *args) {
   // we aren't profiling
-  if (current_state != PD_INPROFILE) {
-    return break_state("No profile to end", false);
+  if (st->current_state != PD_INPROFILE) {
+    return break_state(st, "No profile to end", false);
   }
-#ifdef USE_MPI
-  runtime += MPI_Wtime() - t_start;
-#else
-  runtime += std::chrono::duration<double, std::ratio<1,1>>
-            (std::chrono::high_resolution_clock::now() - t_start).count();
-#endif
-  event_set->stop();
-  update_counter_values();
-  current_state = PD_INREGION;
+  const double elapsed = wtime() - st->t_start;
+  st->event_sets[st->current_set]->stop();
+  stop_sampling(st);
+  if (st->memory) {
+    MemoryUsage memory_end;
+    read_memory(st, memory_end, &st->memory_start);
+    add_memory_usage(st->memory_start, memory_end, st->record);
+  }
+  if (st->trace)
+    trace_event(st, st->t_start, elapsed, st->current_set,
+                st->event_sets[st->current_set]->values);
+  update_counter_values(st);
+  st->runtime += elapsed;
+  st->set_runtime[st->current_set] += elapsed;
+  // the next profile uses the next event set in round-robin order
+  st->current_set = (st->current_set + 1) % st->event_sets.size();
+  st->current_state = PD_INREGION;
   Py_RETURN_NONE;
 }
 
-static PyObject *method_end_region(PyObject *self, PyObject *args) {
-  if (current_state != PD_INREGION) {
+static PyObject *end_region_impl(PyPerfDumpState *st,
+                                  PyObject *self, PyObject *args) {
+  if (st->current_state != PD_INREGION) {
     // if we're actually profiling
-    if (current_state == PD_INPROFILE) {
+    if (st->current_state == PD_INPROFILE) {
 #ifdef DECREFNONE
       PyObject *none =
 #endif
-      break_state("Implicitly ending profile with call to end region", false);
+      break_state(st, "Implicitly ending profile with call to end region",
+                  false);
 #ifdef DECREFNONE
       Py_DECREF(none);
       none =
 #endif
-      method_end_profile(self, args);
+      end_profile_impl(st, self, args);
 #ifdef DECREFNONE
       Py_DECREF(none);
 #endif
     }
     // otherwise we're not even in a region
-    else return break_state("No region to end", false);
+    else return break_state(st, "No region to end", false);
   }
-  dump(rank, num_procs,
-        filename.c_str(), region_name, event_set, buffer, runtime);
-  buffer.clear();
-  if (generic_region_name) {
-    delete [] generic_region_name;
-    generic_region_name = nullptr;
+  // extrapolate counts of rotated event sets to the full region runtime
+  if (st->event_sets.size() > 1)
+    extrapolate_counter_values(st);
+  st->record.metrics["Runtime"] = st->runtime;
+  st->set_runtime.assign(st->event_sets.size(), 0.0);
+  if (st->trace)
+    trace_event(st, st->region_start, wtime() - st->region_start, -1, nullptr);
+  if (st->aggregate) {
+    aggregate_region(st);
+    st->record.counters.clear();
+    st->record.metrics.clear();
+    Py_CLEAR(st->region_name_obj);
+    st->current_state = PD_LIBINIT;
+    Py_RETURN_NONE;
   }
-  current_state = PD_LIBINIT;
+  // move the region out of the state before releasing the GIL to dump
+  PyObject *name = st->region_name_obj;
+  st->region_name_obj = nullptr;
+  RegionRecord record;
+  record.counter_names = st->record.counter_names;
+  record.metric_names = st->record.metric_names;
+  record.counters.swap(st->record.counters);
+  record.metrics.swap(st->record.metrics);
+  const std::string filename(st->filename);
+  const bool sampling = st->sampling;
+  const std::string samples = (sampling)? sample_lines(st) : std::string();
+  const std::string sample_filename(st->sample_filename);
+  st->current_state = PD_LIBINIT;
+  dump_record(st->dump, st->rank, st->num_procs, filename,
+              PyUnicode_AsUTF8(name), record);
+  if (sampling)
+    dump_lines(st->rank, st->num_procs, sample_filename, samples);
+  Py_DECREF(name);
   Py_RETURN_NONE;
 }
 
-static PyObject *method_finalize(PyObject *self,PyObject *args) {
+/***
+measure - call a callable repeat times after warmup calls, each call is
+          profiled and the median, min and median absolute deviation
+          of each counter and the runtime are returned and dumped
+***/
+static PyObject *measure_impl(PyPerfDumpState *st, PyObject *self,
+                              PyObject *args, PyObject *kwargs) {
+  static const char *kwlist[] = {"callable", "repeat", "warmup", "name",
+                                  nullptr};
+  PyObject *callable = nullptr, *name = nullptr;
+  int repeat = 10, warmup = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiU",
+                                    const_cast<char**>(kwlist),
+                                    &callable, &repeat, &warmup, &name))
+    return NULL;
+  if (!PyCallable_Check(callable) || repeat < 1 || warmup < 0) {
+    PyErr_SetString(PyExc_ValueError,
+        "measure needs a callable, repeat >= 1 and warmup >= 0");
+    return NULL;
+  }
+  // a measurement is a region of its own
+  if (st->current_state != PD_LIBINIT) {
+    return break_state(st, "Cannot measure here", false);
+  }
+  if (!begin_region(st, name))
+    return NULL;
+  // the callable can't start regions or profiles while it is measured
+  st->current_state = PD_INMEASURE;
+  const std::vector<std::string> &counter_names = st->record.counter_names;
+  const size_t num_counters = counter_names.size();
+  // the samples of each counter and then the runtime, preallocated so the
+  // loop doesn't allocate between calls
+  std::vector<std::vector<double>> samples(num_counters + 1);
+  for (auto &counter_samples : samples)
+    counter_samples.reserve(repeat);
+  own_event_sets(st);
+  bool failed = false;
+  for (int i = 0; !failed && i < warmup; ++i) {
+    PyObject *result = PyObject_Vectorcall(callable, nullptr, 0, nullptr);
+    failed = !result;
+    Py_XDECREF(result);
+  }
+  // the faults of each call are also sampled, the memory counters follow
+  // the event counters in the names
+  const size_t memory_index = std::find(counter_names.begin(),
+                                        counter_names.end(), "MinorFaults")
+                              - counter_names.begin();
+  MemoryUsage memory_start, memory_end;
+  for (int i = 0; !failed && i < repeat; ++i) {
+    PAPIEventSet *const event_set = st->event_sets[st->current_set];
+    if (st->memory)
+      read_memory(st, memory_start, nullptr);
+    start_sampling(st);
+    const double t_start = wtime();
+    event_set->start();
+    PyObject *result = PyObject_Vectorcall(callable, nullptr, 0, nullptr);
+    event_set->stop();
+    const double elapsed = wtime() - t_start;
+    stop_sampling(st);
+    if ((failed = !result))
+      break;
+    if (st->memory)
+      read_memory(st, memory_end, &memory_start);
+    Py_DECREF(result);
+    if (st->memory) {
+      samples[memory_index].push_back(memory_end.minor_faults -
+                                      memory_start.minor_faults);
+      samples[memory_index + 1].push_back(memory_end.major_faults -
+                                          memory_start.major_faults);
+    }
+    if (st->trace)
+      trace_event(st, t_start, elapsed, st->current_set, event_set->values);
+    // with event rotation each counter is sampled by its set's calls
+    const std::vector<size_t> &counter_index =
+                                    st->set_counter_index[st->current_set];
+    for (size_t k = 0; k < counter_index.size(); ++k)
+      samples[counter_index[k]].push_back(event_set->values[k]);
+    samples[num_counters].push_back(elapsed);
+    st->current_set = (st->current_set + 1) % st->event_sets.size();
+  }
+  // an exception from the callable ends the measurement without a dump
+  if (failed) {
+    Py_CLEAR(st->region_name_obj);
+    st->current_state = PD_LIBINIT;
+    return NULL;
+  }
+  // the statistics are the metrics of the record, the calls are its count
+  RegionRecord record;
+  record.counter_names.push_back("Count");
+  record.counters["Count"] = repeat;
+  static const char *stat_names[] = {"median", "min", "mad"};
+  PyObject *stats_dict = PyDict_New();
+  for (size_t c = 0; stats_dict && c <= num_counters; ++c) {
+    const std::string &counter = (c < num_counters)?
+                                  counter_names[c] : std::string("Runtime");
+    const Py_ssize_t count = samples[c].size();
+    double stats[3];
+    measure_stats(samples[c], stats);
+    for (int k = 0; k < 3; ++k) {
+      const std::string metric = counter + ":" + stat_names[k];
+      record.metric_names.push_back(metric);
+      record.metrics[metric] = stats[k];
+    }
+    PyObject *counter_stats = Py_BuildValue("{s:d,s:d,s:d,s:n}",
+                                            "median", stats[0],
+                                            "min", stats[1],
+                                            "mad", stats[2],
+                                            "count", count);
+    if (!counter_stats ||
+        PyDict_SetItemString(stats_dict, counter.c_str(), counter_stats) < 0)
+      Py_CLEAR(stats_dict);
+    Py_XDECREF(counter_stats);
+  }
+  if (st->trace)
+    trace_event(st, st->region_start, wtime() - st->region_start, -1, nullptr);
+  // move the region out of the state before releasing the GIL to dump
+  PyObject *region_name = st->region_name_obj;
+  st->region_name_obj = nullptr;
+  const std::string filename(st->filename);
+  const bool sampling = st->sampling && !st->aggregate;
+  const std::string sample_list = (sampling)? sample_lines(st) : std::string();
+  const std::string sample_filename(st->sample_filename);
+  st->current_state = PD_LIBINIT;
+  dump_record(st->dump, st->rank, st->num_procs, filename,
+              PyUnicode_AsUTF8(region_name), record);
+  if (sampling)
+    dump_lines(st->rank, st->num_procs, sample_filename, sample_list);
+  Py_DECREF(region_name);
+  return stats_dict;
+}
+
+static PyObject *finalize_impl(PyPerfDumpState *st,
+                                PyObject *self, PyObject *args) {
   // We aren't in a state to finalize
-  if (current_state != PD_LIBINIT) {
+  if (st->current_state != PD_LIBINIT) {
     // We aren't even initialized
-    if (current_state == PD_NOTSTARTED) {
-      return break_state("Can\'t finalize before initialization", false);
+    if (st->current_state == PD_NOTSTARTED) {
+      return break_state(st, "Can\'t finalize before initialization", false);
     }
 #ifdef DECREFNONE
     PyObject *none =
 #endif
-    break_state("Finalize called out of order", false);
+    break_state(st, "Finalize called out of order", false);
 #ifdef DECREFNONE
     Py_DECREF(none);
 #endif
     // stop profiling if we're profiling
-    if (current_state == PD_INPROFILE) {
+    if (st->current_state == PD_INPROFILE) {
 #ifdef DECREFNONE
       none =
 #endif
-      method_end_profile(self, args);
+      end_profile_impl(st, self, args);
 #ifdef DECREFNONE
       Py_DECREF(none);
 #endif
@@ -389,18 +1885,45 @@ static PyObject *method_finalize(PyObject *self,PyObject *args) {
 #ifdef DECREFNONE
     none =
 #endif
-    method_end_region(self, args);
+    end_region_impl(st, self, args);
 #ifdef DECREFNONE
     Py_DECREF(none);
 #endif
+    // another thread may have finalized while the region was dumped
+    if (st->current_state != PD_LIBINIT)
+      return break_state(st, "Finalize called concurrently", false);
     // we are now in the correct state
   }
+  // take the aggregated regions to write them after resetting the state
+  std::vector<RegionAggregate> aggregates;
+  aggregates.swap(st->aggregates);
+  st->aggregate_ids.clear();
+  RegionRecord aggregate_record;
+  std::swap(aggregate_record, st->aggregate_record);
+  const std::string filename(st->filename);
+  // with aggregation the samples of all regions are written at finalize
+  const bool sampling = st->sampling && st->aggregate;
+  const std::string samples = (sampling)? sample_lines(st) : std::string();
+  const std::string sample_filename(st->sample_filename);
+  st->sampling = false;
+  // the trace is written by all ranks at finalize
+  const bool trace = st->trace;
+  const std::string trace_list = (trace)? trace_lines(st) : std::string();
+  const std::string trace_filename(st->trace_filename);
+  st->trace = false;
   // put our state back to where we could do init() again
-  delete event_set;
-  event_set = nullptr;
-  current_state = PD_NOTSTARTED;
+  free_event_sets(st);
+  release_memory(st);
+  st->current_state = PD_NOTSTARTED;
+  // write the aggregated regions
+  flush_aggregates(st->dump, st->rank, st->num_procs, filename,
+                    aggregates, aggregate_record);
+  if (sampling)
+    dump_lines(st->rank, st->num_procs, sample_filename, samples);
+  if (trace)
+    write_trace(st->rank, st->num_procs, trace_filename, trace_list);
   // let PAPI release resources and decrement our reference count
-  PAPI_shutdown();
+  papi_release();
   Py_DECREF(self);
   Py_RETURN_NONE;
 }
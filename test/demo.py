@@ -6,6 +6,8 @@ try:
 except ModuleNotFoundError:
   pass
 
+import threading
+
 import pyperfdump
 
 # debugmsg can be swapped to optionally silence script messages
@@ -18,6 +20,14 @@ def run():
     for x in range(1000):
       i+=123
 
+# Profile run() in a region on another thread than init()
+def run_thread():
+  pyperfdump.start_region('thread_region')
+  pyperfdump.start_profile()
+  run()
+  pyperfdump.end_profile()
+  pyperfdump.end_region()
+
 if __name__=='__main__':
   debugmsg('Calling pyperfdump.init()',flush=True)
   pyperfdump.init()
@@ -31,6 +41,13 @@ if __name__=='__main__':
   pyperfdump.end_profile()
   debugmsg('Calling pyperfdump.end_region()',flush=True)
   pyperfdump.end_region()
+  debugmsg('Calling run_thread() on a thread',flush=True)
+  thread = threading.Thread(target=run_thread)
+  thread.start()
+  thread.join()
+  debugmsg('Calling pyperfdump.measure()',flush=True)
+  stats = pyperfdump.measure(run, repeat=5, name='measure_region')
+  debugmsg('Median Runtime of run():',stats['Runtime']['median'],flush=True)
   debugmsg('Calling pyperfdump.finalize()',flush=True)
   pyperfdump.finalize()
 
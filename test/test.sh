@@ -189,5 +189,135 @@ else
   echo "csv output appears correct"
 fi
 
+# The measured callable has a count and statistics of each counter
+for pattern in "measure_region,Count" "Runtime:median" "Runtime:min" \
+                "Runtime:mad" ; do
+  if ! grep -q "$pattern" "$csvfile" ; then
+    echo "csv output doesn't contain $pattern of measure() and should"
+    exit 1
+  fi
+done
+echo "measure() output appears correct"
+
+# A profile on another thread than init() is counted
+if ! grep -q "thread_region,Runtime" "$csvfile" ; then
+  echo "csv output doesn't contain the Runtime of thread_region and should"
+  exit 1
+fi
+echo "Profile on a thread appears correct"
+
+# Check the query tool if it was built for testing
+PDQUERY="$(find "build/install" -type f -name pdquery 2>/dev/null)"
+if [ -x "$PDQUERY" ] ; then
+  if ! "$PDQUERY" -s "$csvfile" | grep -q "testing_region,Runtime" ; then
+    echo "pdquery summary doesn't contain the Runtime of testing_region"
+    exit 1
+  fi
+  echo "pdquery output appears correct"
+fi
+
+# A dump compared to itself has no regressions
+PDDIFF="$(find "build/install" -type f -name pddiff 2>/dev/null)"
+if [ -x "$PDDIFF" ] ; then
+  if ! "$PDDIFF" "$csvfile" "$csvfile" | grep -q "testing_region,Runtime" ; then
+    echo "pddiff doesn't compare the Runtime of testing_region to itself"
+    exit 1
+  fi
+  # A known regression, ten times the Runtime, sets the exit code
+  rm -f pddiff_base.csv pddiff_new.csv
+  for value in 10 11 9 12 ; do
+    echo "diff_region,Runtime,$value" >> pddiff_base.csv
+    echo "diff_region,Runtime,${value}0" >> pddiff_new.csv
+  done
+  "$PDDIFF" pddiff_base.csv pddiff_new.csv >/dev/null 2>&1
+  status=$?
+  rm pddiff_base.csv pddiff_new.csv
+  if [ "$status" -ne 2 ] ; then
+    echo "pddiff exits with $status for a regression instead of 2"
+    exit 1
+  fi
+  echo "pddiff output appears correct"
+fi
+
+# The counters that were chosen, for event groups
+COUNTERS="$(grep -o "testing_region,[^,]*" "$csvfile" | cut -d, -f2 | \
+            grep -v "^Runtime$" | sort -u)"
+
+# Run the test with an option and check the csv output contains a pattern
+# usage: OPTION=value check_option "description" pattern...
+check_option() {
+  local description="$1"
+  shift
+  [ -f "$csvfile" ] && rm "$csvfile"
+  echo "$cmd"
+  $cmd
+  for pattern in "$@" ; do
+    if ! grep -q "$pattern" "$csvfile" ; then
+      echo "csv output with $description doesn't contain $pattern and should"
+      exit 1
+    fi
+  done
+  echo "csv output with $description appears correct"
+}
+export PDUMP_OUTPUT_FORMAT=csv
+
+# Two groups of one counter each are rotated across profiles
+if [ "$(echo "$COUNTERS" | wc -l)" -ge 2 ] ; then
+  PDUMP_EVENT_GROUPS="$(echo "$COUNTERS" | head -n 2 | paste -s -d ';')" \
+    check_option "event groups" "Coverage_1" "Coverage_2"
+else
+  echo "Only one counter available, not testing event groups"
+fi
+
+PDUMP_AGGREGATE=1 check_option "aggregation" "testing_region,Count" \
+                                              "Runtime:sum"
+
+# Memory usage is written with the counters, byte counts in full
+PDUMP_MEMORY=1 check_option "memory usage" "MinorFaults" \
+                                            "testing_region,PeakRSS,[0-9]*$"
+
+# The trace is one JSON file, also when events are dropped
+tracefile="perf_dump.trace.json"
+for limit in 1000000 1 ; do
+  [ -f "$tracefile" ] && rm "$tracefile"
+  PDUMP_TRACE=1 PDUMP_TRACE_LIMIT=$limit check_option "tracing" "Runtime"
+  if ! python3 -m json.tool "$tracefile" >/dev/null ; then
+    echo "Trace output isn't valid JSON"
+    exit 1
+  elif ! grep -q "testing_region" "$tracefile" ; then
+    echo "Trace output doesn't contain testing_region and should"
+    exit 1
+  fi
+done
+echo "Trace output appears correct"
+
+# Events of other PAPI components are counted with a CPU counter
+CPU_COUNTER="$(echo "$COUNTERS" | grep -v ":::" | head -n 1)"
+COMPONENT_EVENTS="$(echo "$PDUMP_EVENTS" | tr ',' '\n' | grep ":::" | \
+                    paste -s -d ',')"
+if [ -n "$CPU_COUNTER" ] && [ -n "$COMPONENT_EVENTS" ] ; then
+  PDUMP_EVENTS="$CPU_COUNTER,$COMPONENT_EVENTS" \
+    check_option "component events" "testing_region,$CPU_COUNTER," \
+                                    "testing_region,[^,]*:::"
+else
+  echo "No events of other components available, not testing components"
+fi
+
+# Samples of a counter are attributed to the lines of demo.py
+samplefile="perf_dump.samples.csv"
+if [ -z "$CPU_COUNTER" ] ; then
+  echo "No CPU counter available, not testing sampling"
+elif ! python3 -c 'import sys; sys.exit(not (3,10) <= sys.version_info[:2] <= (3,13))' ; then
+  echo "Sampling isn't supported by this Python, not testing sampling"
+else
+  [ -f "$samplefile" ] && rm "$samplefile"
+  PDUMP_OVERFLOW="$CPU_COUNTER@1000000" check_option "sampling" "Runtime"
+  if ! grep -q "testing_region,[^,]*demo.py:run," "$samplefile" 2>/dev/null ; then
+    echo "Sample output doesn't contain samples of demo.py and should"
+    exit 1
+  fi
+  echo "Sample output appears correct"
+fi
+
 echo "Test successful"
 exit 0
@@ -0,0 +1,368 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef ENABLE_HDF5
+  #include <hdf5.h>
+#endif
+
+#include "dump_reader.h"
+
+int DumpIndex::find_region(const std::string &name) const {
+  const auto it = region_ids_.find(name);
+  return (it == region_ids_.end())? -1 : static_cast<int>(it->second);
+}
+
+int DumpIndex::find_event(const std::string &name) const {
+  const auto it = event_ids_.find(name);
+  return (it == event_ids_.end())? -1 : static_cast<int>(it->second);
+}
+
+const std::vector<DumpValue>* DumpIndex::values(const unsigned region,
+                                                const unsigned event) const {
+  const auto it = values_.find(key(region, event));
+  return (it == values_.end())? nullptr : &it->second;
+}
+
+unsigned DumpIndex::intern_region(const std::string &name) {
+  const auto it = region_ids_.find(name);
+  if (it != region_ids_.end())
+    return it->second;
+  const unsigned id = regions_.size();
+  region_ids_[name] = id;
+  regions_.push_back(name);
+  region_events_.push_back(std::vector<unsigned>());
+  return id;
+}
+
+unsigned DumpIndex::intern_event(const std::string &name) {
+  const auto it = event_ids_.find(name);
+  if (it != event_ids_.end())
+    return it->second;
+  const unsigned id = events_.size();
+  event_ids_[name] = id;
+  events_.push_back(name);
+  return id;
+}
+
+void DumpIndex::add(const unsigned region, const unsigned event,
+                    const int rank, const double value) {
+  std::vector<DumpValue> &entries = values_[key(region, event)];
+  if (entries.empty())
+    region_events_[region].push_back(event);
+  // remember where this source's values of the region and event begin
+  if (source_start_.find(key(region, event)) == source_start_.end())
+    source_start_[key(region, event)] = entries.size();
+  const DumpValue entry = {static_cast<unsigned>(sources_.size() - 1),
+                            rank, 0, value};
+  entries.push_back(entry);
+}
+
+void DumpIndex::finish_source() {
+  for (const auto &start : source_start_) {
+    std::vector<DumpValue> &entries = values_[start.first];
+    const auto first = entries.begin() + start.second;
+    // values were added in file order, a stable sort keeps instance order
+    std::stable_sort(first, entries.end(),
+                      [](const DumpValue &a, const DumpValue &b) {
+                        return a.rank < b.rank;
+                      });
+    unsigned instance = 0;
+    for (auto it = first; it != entries.end(); ++it) {
+      if (it != first && it->rank != (it-1)->rank)
+        instance = 0;
+      it->instance = instance++;
+    }
+  }
+  source_start_.clear();
+}
+
+#ifdef ENABLE_HDF5
+// HDF5 isn't necessarily thread-safe, dumps are read from HDF5 one at a time
+static std::mutex hdf5_mutex;
+#endif
+
+bool DumpIndex::load(const std::string &path, const unsigned num_threads) {
+  // HDF5 files begin with an 8 byte signature
+  char signature[8] = {0};
+  FILE *file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    std::fprintf(stderr, "Unable to open \"%s\"\n", path.c_str());
+    return false;
+  }
+  const size_t nread = std::fread(signature, 1, sizeof(signature), file);
+  std::fclose(file);
+  sources_.push_back(path);
+  bool loaded;
+  if (nread == sizeof(signature) &&
+      !std::memcmp(signature, "\211HDF\r\n\032\n", sizeof(signature))) {
+#ifdef ENABLE_HDF5
+    std::lock_guard<std::mutex> lock(hdf5_mutex);
+    loaded = load_hdf5(path);
+#else
+    std::fprintf(stderr, "HDF5 is not enabled, can't read \"%s\"\n",
+                  path.c_str());
+    loaded = false;
+#endif
+  }
+  else
+    loaded = load_csv(path, num_threads);
+  finish_source();
+  return loaded;
+}
+
+/***
+csv parsing - each thread parses lines of its chunk of the mapped file
+              with its own interned names, which are merged in chunk order
+***/
+namespace {
+struct CsvRow {
+  unsigned region, event;
+  int rank;
+  double value;
+};
+
+struct CsvChunk {
+  const char *begin, *end;
+  std::vector<std::string> regions, events;
+  std::vector<CsvRow> rows;
+  size_t bad_lines;
+};
+
+unsigned intern_local(std::unordered_map<std::string,unsigned> &ids,
+                      std::vector<std::string> &names,
+                      const char *begin, const char *end) {
+  const std::string name(begin, end - begin);
+  const auto it = ids.find(name);
+  if (it != ids.end())
+    return it->second;
+  ids[name] = names.size();
+  names.push_back(name);
+  return names.size() - 1;
+}
+
+// Lines are "rank,region,event,value" with MPI or "region,event,value"
+// The line is split from the right so region names may contain commas
+void parse_chunk(CsvChunk *chunk) {
+  std::unordered_map<std::string,unsigned> region_ids, event_ids;
+  chunk->bad_lines = 0;
+  const char *line = chunk->begin;
+  while (line < chunk->end) {
+    const char *eol = static_cast<const char*>(
+                        std::memchr(line, '\n', chunk->end - line));
+    if (!eol)
+      eol = chunk->end;
+    // find the last two commas, the value and event are after them
+    const char *value_comma = nullptr, *event_comma = nullptr;
+    for (const char *c = eol; c > line; --c) {
+      if (c[-1] == ',') {
+        if (!value_comma)
+          value_comma = c - 1;
+        else {
+          event_comma = c - 1;
+          break;
+        }
+      }
+    }
+    if (!event_comma) {
+      if (eol > line)
+        ++chunk->bad_lines;
+      line = eol + 1;
+      continue;
+    }
+    CsvRow row;
+    row.value = std::strtod(value_comma + 1, nullptr);
+    row.event = intern_local(event_ids, chunk->events,
+                              event_comma + 1, value_comma);
+    // a leading integer field is the rank
+    const char *region = line;
+    row.rank = 0;
+    const char *rank_comma = static_cast<const char*>(
+                              std::memchr(line, ',', event_comma - line));
+    if (rank_comma && rank_comma > line) {
+      const char *c = line;
+      while (c < rank_comma && *c >= '0' && *c <= '9')
+        ++c;
+      if (c == rank_comma) {
+        row.rank = std::atoi(line);
+        region = rank_comma + 1;
+      }
+    }
+    row.region = intern_local(region_ids, chunk->regions,
+                              region, event_comma);
+    chunk->rows.push_back(row);
+    line = eol + 1;
+  }
+}
+} // namespace
+
+bool DumpIndex::load_csv(const std::string &path,
+                          const unsigned num_threads) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::fprintf(stderr, "Unable to open \"%s\"\n", path.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  const size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::fprintf(stderr, "Unable to map \"%s\"\n", path.c_str());
+    return false;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  const char *const data = static_cast<const char*>(map);
+  // split the file into chunks that begin and end at line boundaries
+  const size_t nchunks = std::max(1u, std::min<unsigned>(num_threads,
+                                        size / (1 << 16) + 1));
+  std::vector<CsvChunk> chunks(nchunks);
+  const char *begin = data;
+  for (size_t i = 0; i < nchunks; ++i) {
+    const char *end = data + size * (i + 1) / nchunks;
+    if (end < begin)
+      end = begin;
+    if (i + 1 < nchunks) {
+      const char *eol = static_cast<const char*>(
+                          std::memchr(end, '\n', data + size - end));
+      end = (eol)? eol + 1 : data + size;
+    }
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    begin = end;
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nchunks; ++i)
+    threads.push_back(std::thread(parse_chunk, &chunks[i]));
+  parse_chunk(&chunks[0]);
+  for (auto &thread : threads)
+    thread.join();
+  munmap(map, size);
+  // merge the chunks in file order into the index
+  size_t bad_lines = 0;
+  for (const auto &chunk : chunks) {
+    std::vector<unsigned> regions, events;
+    for (const auto &name : chunk.regions)
+      regions.push_back(intern_region(name));
+    for (const auto &name : chunk.events)
+      events.push_back(intern_event(name));
+    for (const auto &row : chunk.rows)
+      add(regions[row.region], events[row.event], row.rank, row.value);
+    bad_lines += chunk.bad_lines;
+  }
+  if (bad_lines)
+    std::fprintf(stderr, "Skipped %zu malformed lines in \"%s\"\n",
+                  bad_lines, path.c_str());
+  return true;
+}
+
+#ifdef ENABLE_HDF5
+namespace {
+// Collect the names of links of a group in HDF5's native order
+herr_t collect_name(hid_t, const char *name, const H5L_info_t*, void *data) {
+  static_cast<std::vector<std::string>*>(data)->push_back(name);
+  return 0;
+}
+} // namespace
+
+// Each region is a group and each event a dataset of [ranks, 1, steps]
+// The last step is the extent that the next dump will write
+bool DumpIndex::load_hdf5(const std::string &path) {
+  const hid_t h5file = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (h5file == H5I_INVALID_HID) {
+    std::fprintf(stderr, "Unable to open \"%s\"\n", path.c_str());
+    return false;
+  }
+  std::vector<std::string> group_names;
+  H5Literate(h5file, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr,
+              collect_name, &group_names);
+  // values are read in chunks of whole ranks up to this many values
+  const hsize_t max_chunk = 1 << 20;
+  std::vector<double> chunk;
+  for (const auto &group_name : group_names) {
+    const hid_t group_id = H5Gopen(h5file, group_name.c_str(), H5P_DEFAULT);
+    if (group_id == H5I_INVALID_HID)
+      continue;
+    const unsigned region = intern_region(group_name);
+    std::vector<std::string> dataset_names;
+    H5Literate(group_id, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr,
+                collect_name, &dataset_names);
+    for (const auto &dataset_name : dataset_names) {
+      const hid_t dataset_id = H5Dopen(group_id, dataset_name.c_str(),
+                                        H5P_DEFAULT);
+      const hid_t space_id = H5Dget_space(dataset_id);
+      if (H5Sget_simple_extent_ndims(space_id) != 3) {
+        H5Sclose(space_id);
+        H5Dclose(dataset_id);
+        continue;
+      }
+      hsize_t dims[3];
+      H5Sget_simple_extent_dims(space_id, dims, nullptr);
+      const unsigned event = intern_event(dataset_name);
+      const hsize_t steps = (dims[2] > 0)? dims[2] - 1 : 0;
+      const hsize_t ranks_per_chunk = (steps > 0)?
+                                  std::max<hsize_t>(1, max_chunk / steps) : 0;
+      for (hsize_t first = 0; steps > 0 && first < dims[0];
+            first += ranks_per_chunk) {
+        const hsize_t nranks = std::min(ranks_per_chunk, dims[0] - first);
+        hsize_t offset[] = {first, 0, 0};
+        hsize_t count[] = {nranks, 1, steps};
+        chunk.resize(nranks * steps);
+        const hid_t memspace_id = H5Screate_simple(3, count, nullptr);
+        H5Sselect_hyperslab(space_id, H5S_SELECT_SET,
+                            offset, nullptr, count, nullptr);
+        H5Dread(dataset_id, H5T_NATIVE_DOUBLE, memspace_id, space_id,
+                H5P_DEFAULT, chunk.data());
+        H5Sclose(memspace_id);
+        for (hsize_t r = 0; r < nranks; ++r) {
+          for (hsize_t t = 0; t < steps; ++t)
+            add(region, event, first + r, chunk[r * steps + t]);
+        }
+      }
+      H5Sclose(space_id);
+      H5Dclose(dataset_id);
+    }
+    H5Gclose(group_id);
+  }
+  H5Fclose(h5file);
+  return true;
+}
+#endif //ENABLE_HDF5
@@ -0,0 +1,406 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "dump_reader.h"
+
+static void usage(const char *const prog) {
+  std::fprintf(stderr,
+"Usage: %s [options] BASELINE CANDIDATE\n"
+"Compare the regions and events of a candidate to a baseline, each is a\n"
+"comma separated list of PyPerfDump csv or HDF5 dumps that are merged\n"
+"  -t THRESHOLD  Relative change of the median reported as a regression\n"
+"                or improvement (default 0.05)\n"
+"  -a ALPHA      Significance level of the Mann-Whitney U test\n"
+"                (default 0.05)\n"
+"  -r REGION     Only compare this region\n"
+"  -e EVENT      Only compare this event\n"
+"  -A            Also compare Count, Coverage, histogram bins and the min,\n"
+"                max and mad of aggregated and measure() dumps\n"
+"  -n N          Values needed on each side for a regression to set the\n"
+"                exit code (default 2)\n"
+"  -o FILE       Write the report to FILE instead of stdout\n"
+"  -j N          Number of threads used to load and compare\n"
+"Exits with 2 if there is a regression of at least N values, 1 on errors\n", prog);
+}
+
+// The comparison of a region and event
+struct Comparison {
+  unsigned region, event;
+  size_t base_count, new_count;
+  double base_median, new_median;
+  // the candidate's median relative to the baseline's
+  double ratio;
+  // the two-sided p-value, NaN if either side has fewer than 2 values
+  double p;
+  enum {SAME, IMPROVEMENT, REGRESSION} status;
+};
+
+/***
+comparable - whether an event is compared by default, counts, coverage,
+             histogram bins and the spread of aggregated regions and
+             measure() depend on how a run was profiled, not its speed
+***/
+static bool comparable(const std::string &event) {
+  static const char *const prefixes[] = {"Count", "Coverage_"};
+  static const char *const infixes[] = {":log2_", ":log2ns_"};
+  static const char *const suffixes[] = {":min", ":max", ":mad"};
+  for (const char *prefix : prefixes) {
+    if (event.compare(0, std::strlen(prefix), prefix) == 0)
+      return false;
+  }
+  for (const char *infix : infixes) {
+    if (event.find(infix) != std::string::npos)
+      return false;
+  }
+  for (const char *suffix : suffixes) {
+    const size_t len = std::strlen(suffix);
+    if (event.size() >= len &&
+        event.compare(event.size() - len, len, suffix) == 0)
+      return false;
+  }
+  return true;
+}
+
+/***
+values_of - the sorted values of a region and event across dumps, ranks
+            and instances
+***/
+static std::vector<double> values_of(const DumpIndex &index,
+                                      const unsigned region,
+                                      const unsigned event) {
+  std::vector<double> values;
+  const std::vector<DumpValue> *dump_values = index.values(region, event);
+  if (dump_values) {
+    values.reserve(dump_values->size());
+    for (const auto &v : *dump_values)
+      values.push_back(v.value);
+  }
+  std::sort(values.begin(), values.end());
+  return values;
+}
+
+static double sorted_median(const std::vector<double> &values) {
+  const size_t n = values.size();
+  if (n == 0)
+    return std::numeric_limits<double>::quiet_NaN();
+  return (n % 2)? values[n/2] : (values[n/2 - 1] + values[n/2]) / 2.0;
+}
+
+// samples up to this size without ties use the exact distribution of U
+static const size_t exact_limit = 20;
+
+/***
+exact_p - the two-sided p-value of a U statistic of samples of n1 and n2
+          values without ties, from the counts of the orderings of the
+          values with each U
+***/
+static double exact_p(const size_t n1, const size_t n2, const double u) {
+  const size_t max_u = n1 * n2;
+  // f[i][k] is the number of orderings of i values of the first sample and
+  // j of the second with a U of k, j is increased from 0 to n2
+  std::vector<std::vector<double>> f(n1 + 1,
+                                      std::vector<double>(max_u + 1, 0.0));
+  for (size_t i = 0; i <= n1; ++i)
+    f[i][0] = 1.0;
+  for (size_t j = 1; j <= n2; ++j) {
+    // the largest value is either of the second sample, or of the first
+    // and greater than the j values of the second
+    for (size_t i = 1; i <= n1; ++i) {
+      for (size_t k = j; k <= max_u; ++k)
+        f[i][k] += f[i-1][k-j];
+    }
+  }
+  // the distribution is symmetric, sum the tail of the smaller U
+  const size_t tail = static_cast<size_t>(std::min(u, max_u - u));
+  double count = 0.0, total = 0.0;
+  for (size_t k = 0; k <= max_u; ++k) {
+    total += f[n1][k];
+    if (k <= tail)
+      count += f[n1][k];
+  }
+  return std::min(2.0 * count / total, 1.0);
+}
+
+/***
+min_p - the smallest two-sided p-value possible with samples of n1 and n2
+        values, when all of one sample is below all of the other
+***/
+static double min_p(const size_t n1, const size_t n2) {
+  // the number of orderings, n1 + n2 choose n1
+  double orderings = 1.0;
+  for (size_t k = 1; k <= n1; ++k)
+    orderings = orderings * (n2 + k) / k;
+  return std::min(2.0 / orderings, 1.0);
+}
+
+/***
+mann_whitney - the two-sided p-value of the Mann-Whitney U test of two
+               sorted samples, exact for small samples without ties or the
+               normal approximation with corrections for ties and
+               continuity, ranks are assigned in one merge
+***/
+static double mann_whitney(const std::vector<double> &a,
+                            const std::vector<double> &b) {
+  const double n1 = a.size(), n2 = b.size(), n = n1 + n2;
+  if (a.size() < 2 || b.size() < 2)
+    return std::numeric_limits<double>::quiet_NaN();
+  // the rank sum of a and the tie correction term
+  double rank_sum = 0.0, ties = 0.0;
+  size_t i = 0, j = 0;
+  double rank = 1.0;
+  while (i < a.size() || j < b.size()) {
+    const double value = (j == b.size() || (i < a.size() && a[i] <= b[j]))?
+                          a[i] : b[j];
+    // count the tied values of each sample
+    size_t ta = 0, tb = 0;
+    while (i < a.size() && a[i] == value) {
+      ++i;
+      ++ta;
+    }
+    while (j < b.size() && b[j] == value) {
+      ++j;
+      ++tb;
+    }
+    const double t = ta + tb;
+    // tied values have the average of their ranks
+    rank_sum += ta * (rank + (t - 1.0) / 2.0);
+    ties += t * t * t - t;
+    rank += t;
+  }
+  const double u = rank_sum - n1 * (n1 + 1.0) / 2.0;
+  if (ties == 0.0 && a.size() <= exact_limit && b.size() <= exact_limit)
+    return exact_p(a.size(), b.size(), u);
+  const double mean = n1 * n2 / 2.0;
+  const double sigma = std::sqrt(n1 * n2 / 12.0 *
+                                  ((n + 1.0) - ties / (n * (n - 1.0))));
+  if (sigma == 0.0)
+    return 1.0;
+  const double z = std::max(std::fabs(u - mean) - 0.5, 0.0) / sigma;
+  return std::erfc(z / std::sqrt(2.0));
+}
+
+/***
+compare - compare the values of a region and event of the two dumps
+***/
+static void compare(const DumpIndex &base, const DumpIndex &candidate,
+                    const double threshold, const double alpha,
+                    Comparison &c) {
+  const std::vector<double> base_values = values_of(base, c.region, c.event);
+  const std::vector<double> new_values = values_of(candidate,
+                          candidate.find_region(base.regions()[c.region]),
+                          candidate.find_event(base.events()[c.event]));
+  c.base_count = base_values.size();
+  c.new_count = new_values.size();
+  c.base_median = sorted_median(base_values);
+  c.new_median = sorted_median(new_values);
+  if (c.base_median == c.new_median)
+    c.ratio = 1.0;
+  else if (c.base_median == 0.0)
+    c.ratio = std::copysign(std::numeric_limits<double>::infinity(),
+                            c.new_median);
+  else
+    c.ratio = c.new_median / c.base_median;
+  c.p = mann_whitney(base_values, new_values);
+  // when the test can't reach alpha with so few values the threshold alone
+  // decides, e.g., with 3 values on each side the smallest p-value is 0.1
+  const bool significant = std::isnan(c.p) ||
+                            min_p(c.base_count, c.new_count) >= alpha ||
+                            c.p < alpha;
+  c.status = Comparison::SAME;
+  if (significant && c.ratio > 1.0 + threshold)
+    c.status = Comparison::REGRESSION;
+  else if (significant && c.ratio < 1.0 - threshold)
+    c.status = Comparison::IMPROVEMENT;
+}
+
+/***
+load - load a comma separated list of dumps into an index
+***/
+static bool load(DumpIndex &index, const std::string &paths,
+                  const unsigned num_threads) {
+  size_t start = 0, next;
+  do {
+    next = paths.find(',', start);
+    const std::string path = paths.substr(start, next - start);
+    if (!path.empty() && !index.load(path, num_threads))
+      return false;
+    start = next + 1;
+  } while (next != std::string::npos);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  double threshold = 0.05, alpha = 0.05;
+  const char *region_name = nullptr, *event_name = nullptr;
+  const char *output_name = nullptr;
+  bool all_events = false;
+  size_t min_values = 2;
+  unsigned num_threads = std::thread::hardware_concurrency();
+  int opt;
+  while ((opt = getopt(argc, argv, "t:a:r:e:An:o:j:h")) != -1) {
+    switch (opt) {
+      case 't':
+        threshold = std::atof(optarg);
+        break;
+      case 'a':
+        alpha = std::atof(optarg);
+        break;
+      case 'r':
+        region_name = optarg;
+        break;
+      case 'e':
+        event_name = optarg;
+        break;
+      case 'A':
+        all_events = true;
+        break;
+      case 'n':
+        min_values = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'o':
+        output_name = optarg;
+        break;
+      case 'j':
+        num_threads = std::atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h')? 0 : 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (num_threads == 0)
+    num_threads = 1;
+  // load the baseline and candidate at the same time, sharing the threads,
+  // the dumps of each are loaded one after another
+  DumpIndex base, candidate;
+  bool base_loaded = false, candidate_loaded = false;
+  {
+    const unsigned load_threads = std::max(num_threads / 2, 1U);
+    std::thread base_thread([&]() {
+      base_loaded = load(base, argv[optind], load_threads);
+    });
+    candidate_loaded = load(candidate, argv[optind + 1], load_threads);
+    base_thread.join();
+  }
+  if (!base_loaded || !candidate_loaded)
+    return 1;
+  // the region and event pairs of the baseline that are in the candidate
+  std::vector<Comparison> comparisons;
+  for (unsigned region = 0; region < base.regions().size(); ++region) {
+    if (region_name && base.regions()[region] != region_name)
+      continue;
+    const int new_region = candidate.find_region(base.regions()[region]);
+    if (new_region < 0)
+      continue;
+    for (const auto &event : base.region_events(region)) {
+      if (event_name && base.events()[event] != event_name)
+        continue;
+      // an event named by -e is compared even if it isn't comparable
+      if (!event_name && !all_events && !comparable(base.events()[event]))
+        continue;
+      const int new_event = candidate.find_event(base.events()[event]);
+      if (new_event < 0 || !candidate.values(new_region, new_event))
+        continue;
+      Comparison c = {};
+      c.region = region;
+      c.event = event;
+      comparisons.push_back(c);
+    }
+  }
+  if (comparisons.empty()) {
+    std::fprintf(stderr, "No regions and events to compare\n");
+    return 1;
+  }
+  // compare the pairs on the threads, each thread takes the next pair
+  {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next.fetch_add(1)) < comparisons.size())
+        compare(base, candidate, threshold, alpha, comparisons[i]);
+    };
+    std::vector<std::thread> threads;
+    const size_t extra_threads = std::min<size_t>(num_threads,
+                                                  comparisons.size()) - 1;
+    for (size_t t = 0; t < extra_threads; ++t)
+      threads.push_back(std::thread(worker));
+    worker();
+    for (auto &t : threads)
+      t.join();
+  }
+  // regressions first, largest ratios first
+  std::stable_sort(comparisons.begin(), comparisons.end(),
+                    [](const Comparison &a, const Comparison &b) {
+                      if (a.status != b.status)
+                        return a.status > b.status;
+                      return a.ratio > b.ratio;
+                    });
+  FILE *out = stdout;
+  if (output_name && !(out = std::fopen(output_name, "w"))) {
+    std::fprintf(stderr, "Unable to open \"%s\"\n", output_name);
+    return 1;
+  }
+  static const char *status_names[] = {"same", "improvement", "regression"};
+  // regressions of fewer values are reported but don't set the exit code
+  size_t regressions = 0, few_values = 0;
+  std::fprintf(out, "region,event,base_count,new_count,"
+                    "base_median,new_median,ratio,p,status\n");
+  for (const auto &c : comparisons) {
+    std::fprintf(out, "%s,%s,%zu,%zu,%.17g,%.17g,%.6g,%.4g,%s\n",
+                  base.regions()[c.region].c_str(),
+                  base.events()[c.event].c_str(),
+                  c.base_count, c.new_count, c.base_median, c.new_median,
+                  c.ratio, c.p, status_names[c.status]);
+    if (c.status != Comparison::REGRESSION)
+      continue;
+    if (c.base_count >= min_values && c.new_count >= min_values)
+      ++regressions;
+    else
+      ++few_values;
+  }
+  if (out != stdout)
+    std::fclose(out);
+  if (few_values) {
+    std::fprintf(stderr, "%zu regressions with fewer than %zu values on a"
+                          " side are not counted\n", few_values, min_values);
+  }
+  if (regressions) {
+    std::fprintf(stderr, "%zu regressions above a threshold of %g\n",
+                  regressions, threshold);
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,214 @@
+//////////////////////////////////////////////////////////////////////////////
+//  PyPerfDump, An MPI- and HDF5- enabled Python module to create PAPI dumps
+//  Copyright (C) 2024, Chase Phelps, chaseleif@icloud.com
+//                     Tanzima Islam, tanzima@txstate.edu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "dump_reader.h"
+
+static void usage(const char *const prog) {
+  std::fprintf(stderr,
+"Usage: %s [options] DUMP [DUMP...]\n"
+"Query PyPerfDump csv or HDF5 dumps, multiple dumps are merged\n"
+"  -l          List regions and their events\n"
+"  -s          Summary statistics per region and event (default)\n"
+"  -t K        The K ranks with the largest total per region and event\n"
+"  -r REGION   Only query this region\n"
+"  -e EVENT    Only query this event\n"
+"  -o FILE     Write the output to FILE instead of stdout\n"
+"  -j N        Number of threads used to parse csv dumps\n", prog);
+}
+
+/***
+list - print the regions and their events with the number of values
+***/
+static void list(FILE *out, const DumpIndex &index,
+                  const std::vector<std::pair<unsigned,unsigned>> &keys) {
+  std::fprintf(out, "region,event,values\n");
+  for (const auto &k : keys) {
+    std::fprintf(out, "%s,%s,%zu\n",
+                  index.regions()[k.first].c_str(),
+                  index.events()[k.second].c_str(),
+                  index.values(k.first, k.second)->size());
+  }
+}
+
+/***
+summary - print aggregate statistics across dumps, ranks and instances
+***/
+static void summary(FILE *out, const DumpIndex &index,
+                    const std::vector<std::pair<unsigned,unsigned>> &keys) {
+  std::fprintf(out, "region,event,dumps,ranks,count,sum,min,mean,max\n");
+  for (const auto &k : keys) {
+    const std::vector<DumpValue> &values = *index.values(k.first, k.second);
+    std::set<std::pair<unsigned,int>> ranks;
+    std::set<unsigned> dumps;
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::max();
+    double max = std::numeric_limits<double>::lowest();
+    for (const auto &v : values) {
+      ranks.insert(std::make_pair(v.source, v.rank));
+      dumps.insert(v.source);
+      sum += v.value;
+      min = std::min(min, v.value);
+      max = std::max(max, v.value);
+    }
+    std::fprintf(out, "%s,%s,%zu,%zu,%zu,%.17g,%.17g,%.17g,%.17g\n",
+                  index.regions()[k.first].c_str(),
+                  index.events()[k.second].c_str(),
+                  dumps.size(), ranks.size(), values.size(),
+                  sum, min, sum / values.size(), max);
+  }
+}
+
+/***
+top - print the K ranks with the largest total over instances
+***/
+static void top(FILE *out, const DumpIndex &index,
+                const std::vector<std::pair<unsigned,unsigned>> &keys,
+                const size_t k) {
+  std::fprintf(out, "region,event,dump,rank,instances,total\n");
+  for (const auto &key : keys) {
+    const std::vector<DumpValue> &values =
+                                      *index.values(key.first, key.second);
+    // values are sorted by dump and rank, total each rank's instances
+    struct Total {
+      unsigned source;
+      int rank;
+      unsigned instances;
+      double total;
+    };
+    std::vector<Total> totals;
+    for (const auto &v : values) {
+      if (totals.empty() || totals.back().source != v.source ||
+          totals.back().rank != v.rank) {
+        const Total t = {v.source, v.rank, 0, 0.0};
+        totals.push_back(t);
+      }
+      ++totals.back().instances;
+      totals.back().total += v.value;
+    }
+    const size_t n = std::min(k, totals.size());
+    std::partial_sort(totals.begin(), totals.begin() + n, totals.end(),
+                      [](const Total &a, const Total &b) {
+                        return a.total > b.total;
+                      });
+    for (size_t i = 0; i < n; ++i) {
+      std::fprintf(out, "%s,%s,%s,%d,%u,%.17g\n",
+                    index.regions()[key.first].c_str(),
+                    index.events()[key.second].c_str(),
+                    index.sources()[totals[i].source].c_str(),
+                    totals[i].rank, totals[i].instances, totals[i].total);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  enum {QUERY_LIST, QUERY_SUMMARY, QUERY_TOP} query = QUERY_SUMMARY;
+  size_t top_k = 0;
+  const char *region_name = nullptr, *event_name = nullptr;
+  const char *output_name = nullptr;
+  unsigned num_threads = std::thread::hardware_concurrency();
+  int opt;
+  while ((opt = getopt(argc, argv, "lst:r:e:o:j:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        query = QUERY_LIST;
+        break;
+      case 's':
+        query = QUERY_SUMMARY;
+        break;
+      case 't':
+        query = QUERY_TOP;
+        top_k = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'r':
+        region_name = optarg;
+        break;
+      case 'e':
+        event_name = optarg;
+        break;
+      case 'o':
+        output_name = optarg;
+        break;
+      case 'j':
+        num_threads = std::atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h')? 0 : 1;
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (num_threads == 0)
+    num_threads = 1;
+  DumpIndex index;
+  for (int i = optind; i < argc; ++i) {
+    if (!index.load(argv[i], num_threads))
+      return 1;
+  }
+  // the region and event pairs to query, in order of appearance
+  std::vector<std::pair<unsigned,unsigned>> keys;
+  const int region_filter = (region_name)? index.find_region(region_name) : -1;
+  const int event_filter = (event_name)? index.find_event(event_name) : -1;
+  if ((region_name && region_filter < 0) || (event_name && event_filter < 0)) {
+    std::fprintf(stderr, "No values for the region and event\n");
+    return 1;
+  }
+  for (unsigned region = 0; region < index.regions().size(); ++region) {
+    if (region_name && static_cast<int>(region) != region_filter)
+      continue;
+    for (const auto &event : index.region_events(region)) {
+      if (event_name && static_cast<int>(event) != event_filter)
+        continue;
+      keys.push_back(std::make_pair(region, event));
+    }
+  }
+  FILE *out = stdout;
+  if (output_name && !(out = std::fopen(output_name, "w"))) {
+    std::fprintf(stderr, "Unable to open \"%s\"\n", output_name);
+    return 1;
+  }
+  switch (query) {
+    case QUERY_LIST:
+      list(out, index, keys);
+      break;
+    case QUERY_SUMMARY:
+      summary(out, index, keys);
+      break;
+    default: // case QUERY_TOP:
+      top(out, index, keys, top_k);
+      break;
+  }
+  if (out != stdout)
+    std::fclose(out);
+  return 0;
+}